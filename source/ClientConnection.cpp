@@ -22,6 +22,7 @@
 
 #include "ClientConnection.h"
 #include "HttpServer.h"
+#include "HttpResponseBuilder.h"
 #include "sha1.h"
 #include "base64.h"
 
@@ -37,6 +38,11 @@
 // max size of the WS Message Header
 #define WEBSOCKETS_MAX_HEADER_SIZE (14)
 
+// close websocket when nothing was received for this time
+#define WEBSOCKET_TIMEOUT   20s
+// check for timeouts at least this often
+#define TICK_INTERVAL       1s
+
 typedef enum {
     WSC_NOT_CONNECTED,
     WSC_HEADER,
@@ -73,29 +79,103 @@ typedef struct {
 
 
 
-ClientConnection::ClientConnection(HttpServer* server, const char* name) :
+ClientConnection::ClientConnection(HttpServer* server, const char* name, EventQueue* eventQueue) :
     _threadClientConnection(osPriorityAboveNormal, 3*1024, nullptr, name),
     _parser(&_request) 
 { 
     _threadName = name;
+    _route = nullptr;
+    _staticRoute = nullptr;
+    _routesInUse = nullptr;
+    _headersInUse = nullptr;
+    _streamBody = false;
+    _errorStatus = 0;
+    _bodyArena = nullptr;
+    _parser.set_url_complete_callback(callback(this, &ClientConnection::onUrlComplete));
+    _parser.set_headers_complete_callback(callback(this, &ClientConnection::onHeadersComplete));
     _isWebSocket = false;
     _server = server;
     _socketIsOpen = false;
-    _threadClientConnection.start(callback(this, &ClientConnection::receiveData));
+    _nextIdle = nullptr;
+    _releasePending = false;
+    _requestCount = 0;
+    _keepAlive = false;
+    memset(&_stats, 0, sizeof(_stats));
+    _recv_buffer = nullptr;
+    _recv_buffer_size = 0;
+    _sendBuffer = nullptr;
+    _sendBufferSize = 0;
+    _sendLen = 0;
+    _corked = false;
+    _headState = -1;
+    _outputOwner = nullptr;
+    _sendError = NSAPI_ERROR_OK;
+    _eventQueue = eventQueue;
+    _eventPending = false;
+    if (_eventQueue) {
+        // event driven: no own thread (and no thread stack), sockets are serviced by the event queue
+        _eventQueue->call_every(TICK_INTERVAL, this, &ClientConnection::onTick);
+    } else {
+        _threadClientConnection.start(callback(this, &ClientConnection::receiveData));
+    }
 };
 
 ClientConnection::~ClientConnection() {
-    _handler = nullptr;
+    releaseRoutes();
+    releaseBodyArena();
 };
 
-void ClientConnection::start(TCPSocket* socket) {
-    _socketIsOpen = true;
+void ClientConnection::countFileSent(size_t bytes, microseconds duration)
+{
+    _stats.filesSent++;
+    _stats.fileBytesSent += bytes;
+    _stats.fileSendTime += duration_cast<milliseconds>(duration).count();
+}
+
+/*
+    called by the accept thread or by the previous run of this connection. The old worker or event may
+    still check _socketIsOpen, so all state is set before the connection is marked open.
+*/
+bool ClientConnection::start(TCPSocket* socket) {
+    // start with a small buffer, there is one for each connection
+    _recv_buffer = _server->getBufferPool().alloc(0, &_recv_buffer_size);
+    if (_recv_buffer == nullptr) {
+        debug("%s: no receive buffer, connection closed\n", _threadName);
+        socket->close();
+        return false;
+    }
+    _recv_len = 0;
+    _parse_pos = 0;
+
     _socket = socket;
-    _socket->set_blocking(true);
+    _releasePending = false;
     _webSocketHandler = nullptr; 
     _parser.clear();
+    _parser.set_body_callback(nullptr);
     _request.clear();
-    _threadClientConnection.flags_set(0x01);
+    _streamBody = false;
+    _errorStatus = 0;
+    _sendError = NSAPI_ERROR_OK;
+    _requestCount = 0;
+    _keepAlive = true;
+    _stats.connections++;
+    _timerIdle.reset();
+    _timerIdle.start();
+    if (_eventQueue) {
+        _socket->set_blocking(false);
+        _socket->sigio(callback(this, &ClientConnection::onSigio));
+    } else {
+        // recv() returns periodically to check the timeouts
+        _socket->set_timeout(duration_cast<milliseconds>(TICK_INTERVAL).count());
+    }
+
+    core_util_atomic_store_bool(&_socketIsOpen, true);
+    if (_eventQueue) {
+        onSigio();                                                  // data may be already waiting, kick first run
+    } else {
+        _threadClientConnection.flags_set(0x01);
+    }
+    return true;
 }
 
 void ClientConnection::textWs(const char *url, const char *text, int length)
@@ -104,100 +184,473 @@ void ClientConnection::textWs(const char *url, const char *text, int length)
         return;
 
     if (_wsOrigin.compare(url) == 0) {
-        sendFrame(WSop_text, (const uint8_t*)text, length);
+        sendFrame(WSop_text, (const uint8_t*)text, length);         // sent right away when called from other threads
     }
 }
 
+/*
+    worker thread, used when running without event queue
+*/
 void ClientConnection::receiveData()
 {
-    bool _wsCloseRequest;
-    bool _closeRequest;
-
     while (1) {
         ThisThread::flags_wait_any(0x01);
-        _wsCloseRequest = false;
-        _closeRequest = false;
 
         debug("%s: run receiveData\n", _threadName);
         while(_socketIsOpen) {
-            nsapi_size_or_error_t recv_ret = _socket->recv(_recv_buffer, HTTP_RECEIVE_BUFFER_SIZE);
+            nsapi_size_or_error_t recv_ret = receive();
             if (recv_ret == NSAPI_ERROR_WOULD_BLOCK) {
-                ThisThread::sleep_for(20ms);
-                break;
+                onTick();                                           // recv timeout
+                continue;
             }
-            debug_if(recv_ret <= 0, "%s: recv_ret: %d\n", _threadName, recv_ret);
-
-            // ws upgrade or simple http handling
-            if (recv_ret > 0) {
-                if (_isWebSocket) {                                         // I'm already a Websocket
-                    _timerWSTimeout.reset();                                // received some data, reset watchdog
-                    _wsCloseRequest = handleWebSocket(recv_ret);                              
-                } else {
-                    int nparsed = _parser.execute((const char*)_recv_buffer, recv_ret);
-                    if (nparsed != recv_ret) {
-                        debug("%s: Parsing failed... parsed %d bytes, received %d bytes\n", _threadName, nparsed, recv_ret);
-                        // recv_ret = -2101;
-                        // _closeRequest = true;
-                        // break;
-                    }
-
-                    if (_request.is_message_complete()) {
-                        if (_request.get_Upgrade()) {                               // is websocket upgrade request?
-                            handleUpgradeRequest();                                 // handle upgrade request 
-                            _timerWSTimeout.reset();
-                            _timerWSTimeout.start();
-                        } else {                                                
-                            _parser.finish();                                       // no websocket, normal http handling
-                            _handler = _server->getHTTPHandler(_request.get_url().c_str());
-                            if (_handler)
-                                _handler(&_request, this);
-                            if (_request.headers["Connection"] == "close")
-                                _closeRequest = true;
-                        } 
-                    }
-                }
-            } 
+            handleReceived(recv_ret);
+        }
+        releaseIfClosed();                                          // the loop is left, the connection can be reused
+    }
+}
 
-            // check for connection close
-            if(_isWebSocket) {
-                if (_wsCloseRequest || (recv_ret == 0) || (_timerWSTimeout.elapsed_time() > 20s) ) {
-                    debug("WS close: wsCloseRequest: %d  recv_ret: %d  timer: %lld\n", _wsCloseRequest, recv_ret, _timerWSTimeout.elapsed_time().count());
-                    _webSocketHandler->onClose();
-                    sendFrame(WSop_close);
-                    _server->decWebsocketCount();                           // websocket was closed, decrement websocket count
-                    if (_webSocketHandler)
-                        delete _webSocketHandler;
-                    _isWebSocket = false;
-                    _socket->close();                                       // close socket. Because allocated by accept(), it will be deleted by itself
-                    _socketIsOpen = false;
-                    _timerWSTimeout.stop();
-                }
-            } else
-            {
-                if (recv_ret == 0 || _closeRequest) {
-                    debug("%s: socket closed, recv_ret: %d  closeRequest: %d\n", _threadName, recv_ret, _closeRequest);
-                    _socket->close();                                       // close socket. Because allocated by accept(), it will be deleted by itself
-                    _socketIsOpen = false;
-                }
+/*
+    socket event, called from network stack context. Only signal and defer the work to the event queue,
+    multiple sigio before the queue runs are collapsed into a single event
+*/
+void ClientConnection::onSigio()
+{
+    _sigioFlags.set(0x01);                                          // wakeup a sender waiting for buffer space
+    if (!core_util_atomic_exchange_bool(&_eventPending, true)) {
+        _eventQueue->call(this, &ClientConnection::processEvents);
+    }
+}
+
+/*
+    event driven receive, runs on the event queue. Reads until the socket would block, then returns
+    to the queue. The connection state (parser, websocket) is kept in the object, so it resumes with
+    the next sigio.
+*/
+void ClientConnection::processEvents()
+{
+    core_util_atomic_store_bool(&_eventPending, false);
+
+    while (_socketIsOpen) {
+        nsapi_size_or_error_t recv_ret = receive();
+        if (recv_ret == NSAPI_ERROR_WOULD_BLOCK) {
+            break;
+        }
+        handleReceived(recv_ret);
+    }
+    releaseIfClosed();
+}
+
+/*
+    periodic check for timeouts, a silent peer does not produce any data or sigio
+*/
+void ClientConnection::onTick()
+{
+    if (!_socketIsOpen)
+        return;
+
+    if (_isWebSocket) {
+        if (_timerIdle.elapsed_time() > WEBSOCKET_TIMEOUT) {
+            debug("%s: WS timeout\n", _threadName);
+            closeConnection();
+        }
+    } else if (_timerIdle.elapsed_time() > milliseconds(HTTP_KEEPALIVE_TIMEOUT)) {
+        debug("%s: keep-alive timeout after %d requests\n", _threadName, _requestCount);
+        _stats.idleTimeouts++;
+        closeConnection();
+    }
+
+    // the worker thread releases after its receive loop, an event handler is done here
+    if (_eventQueue)
+        releaseIfClosed();
+}
+
+/*
+    hand the closed connection back to the server. Only called by the worker thread or event when it
+    no longer uses the connection state, the server may start() the connection again right away.
+*/
+void ClientConnection::releaseIfClosed()
+{
+    if (_releasePending) {
+        _releasePending = false;
+        _server->releaseConnection(this);                           // continue with a waiting connection or go idle
+    }
+}
+
+/*
+    receive into the free space of the buffer, the request data before _recv_len is retained
+    because the parsed request references it
+*/
+nsapi_size_or_error_t ClientConnection::receive()
+{
+    return _socket->recv(_recv_buffer + _recv_len, _recv_buffer_size - _recv_len);
+}
+
+void ClientConnection::handleReceived(nsapi_size_or_error_t recv_ret)
+{
+    bool wsCloseRequest = false;
+    bool closeRequest = false;
+
+    debug_if(recv_ret <= 0, "%s: recv_ret: %d\n", _threadName, recv_ret);
+
+    _sendMutex.lock();
+    _outputOwner = ThisThread::get_id();                            // output of the handlers is flushed below
+    _sendMutex.unlock();
+
+    // ws upgrade or simple http handling
+    if (recv_ret > 0) {
+        _timerIdle.reset();                                         // received some data, reset watchdog
+        _stats.bytesReceived += recv_ret;
+        if (_isWebSocket) {                                         // I'm already a Websocket
+            wsCloseRequest = handleWebSocket(recv_ret);                              
+            if ((size_t)recv_ret == _recv_buffer_size) {
+                growBuffer();                                       // more data than fits, large frame
+            }
+        } else {
+            _recv_len += recv_ret;
+            closeRequest = handleRequests();
+            if (_isWebSocket && _recv_len > 0) {                    // data after the upgrade request is already websocket
+                wsCloseRequest = handleWebSocket(_recv_len);
+                _recv_len = 0;
+            }
+        }
+    } 
+
+    // responses of all requests in this receive go out together
+    endOutput();
+
+    // check for connection close, output that could not be sent leaves the stream broken
+    if (_sendError < 0) {
+        debug("%s: send failed: %d\n", _threadName, _sendError);
+        closeConnection();
+    } else if(_isWebSocket) {
+        if (wsCloseRequest || (recv_ret <= 0) || (_timerIdle.elapsed_time() > WEBSOCKET_TIMEOUT) ) {
+            debug("WS close: wsCloseRequest: %d  recv_ret: %d  timer: %lld\n", wsCloseRequest, recv_ret, _timerIdle.elapsed_time().count());
+            closeConnection();
+        }
+    } else
+    {
+        if (recv_ret <= 0 || closeRequest) {
+            debug("%s: socket closed, recv_ret: %d  closeRequest: %d\n", _threadName, recv_ret, closeRequest);
+            closeConnection();
+        }
+    }
+}
+
+/*
+    parse the received data and dispatch all requests that are complete. Requests are handled strictly
+    in order, so pipelined responses are in order, too. Data of an incomplete request stays in the buffer.
+
+    @return true if the connection should be closed
+*/
+bool ClientConnection::handleRequests()
+{
+    bool closeRequest = false;
+
+    while (!closeRequest && !_isWebSocket && (_parse_pos < _recv_len)) {
+        bool bufferFull = (_recv_len == _recv_buffer_size);
+
+        _request.set_buffer((const char*)_recv_buffer);
+        _parse_pos += _parser.execute((const char*)_recv_buffer + _parse_pos, _recv_len - _parse_pos);
+        if (_parser.has_error()) {
+            debug("%s: Parsing failed... parsed %d bytes, received %d bytes\n", _threadName, (int)_parse_pos, (int)_recv_len);
+            if (_errorStatus == 0)
+                _errorStatus = _request.body_too_large() ? 413 : 400;
+            sendError(_errorStatus);
+            return true;
+        }
+
+        if (!_request.is_message_complete()) {
+            if (_request.is_headers_complete()) {
+                // body data is already consumed by the parser, keep only the part with url and headers
+                _recv_len = _request.get_retained_length();
+                _parse_pos = _recv_len;
+            }
+
+            // only a large header needs a large buffer, body data does not stay in the buffer
+            if (bufferFull && !_request.is_headers_complete() && !growBuffer()) {
+                // too large for any buffer, or the large buffers are all in use right now
+                sendError((_recv_buffer_size >= _server->getBufferPool().getLargeSize()) ? 431 : 503);
+                return true;
             }
+            return false;
         }
+
+        // parser is paused after a complete request
+        if (_request.get_Upgrade()) {                                   // is websocket upgrade request?
+            handleUpgradeRequest();                                     // handle upgrade request 
+            _timerIdle.reset();
+            _timerIdle.start();
+        } else {                                                        // no websocket, normal http handling
+            // keep the connection open if the client wants it (HTTP/1.0 rules included) and the budget allows it
+            _requestCount++;
+            _stats.requests++;
+            if (_requestCount > 1)
+                _stats.keepAliveRequests++;
+            _keepAlive = _request.should_keep_alive() && (_requestCount < HTTP_KEEPALIVE_MAX_REQUESTS);
+
+            // a GET handler may answer HEAD, its body is dropped after the header
+            _sendMutex.lock();
+            _headState = (_request.get_method() == HTTP_HEAD) ? 0 : -1;
+            _sendMutex.unlock();
+
+            if (_staticRoute) {
+                _staticRoute->handler(&_request, this);
+            } else {
+                endBody(true);
+                if (_route && _route->handler)
+                    _route->handler(&_request, this);
+            }
+            _sendMutex.lock();
+            _headState = -1;
+            _sendMutex.unlock();
+            if (!_keepAlive)
+                closeRequest = true;                                    // the handler may have requested close, too
+            _timerIdle.reset();
+        } 
+
+        // keep the bytes of the next request and start over
+        _recv_len -= _parse_pos;
+        memmove(_recv_buffer, _recv_buffer + _parse_pos, _recv_len);
+        _parse_pos = 0;
+        _request.clear();
+        _parser.resume();
+        releaseRoutes();
+        releaseBodyArena();
+        shrinkBuffer();                                                 // request done, give back a large buffer
+    }
+
+    return closeRequest;
+}
+
+/*
+    url is known, lookup the route now to apply its header filter to the following headers
+*/
+void ClientConnection::onUrlComplete()
+{
+    // routes stay valid until the request is done, even if they are changed meanwhile
+    const HttpRouteTable* routes = getRoutes();
+
+    // compiled in routes first, they take all headers
+    _staticRoute = routes->findStaticRoute(&_request);
+    if (_staticRoute) {
+        _route = nullptr;
+        _request.set_header_filter(nullptr);
+        return;
+    }
+
+    _route = routes->findHTTPRoute(&_request);
+    _request.set_header_filter(_route ? &_route->headerFilter : nullptr);
+}
+
+/*
+    headers are complete, decide if the body is streamed to the route
+*/
+bool ClientConnection::onHeadersComplete()
+{
+    if (_route && _route->body.chunk && !_request.get_Upgrade()) {
+        if (_route->body.begin) {
+            int status = _route->body.begin(&_request, this);
+            if (status != 0) {
+                _errorStatus = status;                                  // rejected, stop parsing
+                return false;
+            }
+        }
+        _streamBody = true;
+        _parser.set_body_callback(callback(this, &ClientConnection::onBodyChunk));
+        return true;
+    }
+
+    if (_parser.has_body()) {
+        // buffered body, reject what cannot fit before reading it
+        uint64_t contentLength = _parser.get_content_length();
+        if ((contentLength != ULLONG_MAX) && (contentLength > HTTP_BODY_ARENA_SIZE)) {
+            _errorStatus = 413;
+            return false;
+        }
+
+        // from the pool until the request is done
+        size_t size;
+        _bodyArena = _server->getBodyPool().alloc(HTTP_BODY_ARENA_SIZE, &size);
+        if (_bodyArena == nullptr) {
+            _errorStatus = 503;                                         // all arenas in use right now
+            return false;
+        }
+        _request.set_body_arena((char*)_bodyArena, HTTP_BODY_ARENA_SIZE);
+    }
+    return true;
+}
+
+void ClientConnection::releaseBodyArena()
+{
+    _server->getBodyPool().free(_bodyArena);
+    _bodyArena = nullptr;
+}
+
+void ClientConnection::onBodyChunk(const char *at, uint32_t length)
+{
+    _route->body.chunk(&_request, at, length);
+}
+
+/*
+    the streamed body of the request is complete or the request is dropped. Either end or abort of
+    the route is called once, so it can release what begin took
+*/
+void ClientConnection::endBody(bool complete)
+{
+    if (!_streamBody)
+        return;
+
+    _streamBody = false;
+    _parser.set_body_callback(nullptr);
+    if (complete && _route->body.end)
+        _route->body.end(&_request, this);
+    else if (!complete && _route->body.abort)
+        _route->body.abort(&_request);
+}
+
+void ClientConnection::sendError(uint16_t statusCode)
+{
+    _keepAlive = false;
+    HttpResponseBuilder builder(this);
+    builder.headers.set("Connection", "close");
+    const char* reason = get_http_status_string(statusCode);
+    builder.sendContent(statusCode, reason, strlen(reason), "text/plain");
+}
+
+void ClientConnection::closeConnection()
+{
+    if (_isWebSocket) {
+        _webSocketHandler->onClose();
+        sendFrame(WSop_close);
+        _server->decWebsocketCount();                               // websocket was closed, decrement websocket count
+        if (_webSocketHandler)
+            delete _webSocketHandler;
+        _webSocketHandler = nullptr;
+        _isWebSocket = false;
+        _timerIdle.stop();
+    }
+    if (_eventQueue) {
+        _socket->sigio(nullptr);
+    }
+    endBody(false);                                                 // upload cut short by an error, timeout or the peer
+    endOutput();
+    _socket->close();                                               // close socket. Because allocated by accept(), it will be deleted by itself
+    releaseRoutes();
+    releaseBodyArena();
+    _server->getBufferPool().free(_recv_buffer);
+    _recv_buffer = nullptr;
+    _recv_buffer_size = 0;
+    _recv_len = 0;
+    setIdle();                                                      // ends the receive loop
+    _releasePending = true;                                         // released when the loop is left
+}
+
+/*
+    the thread in handleReceived(), it owns the hazard pointers of the connection
+*/
+bool ClientConnection::isHandlerThread()
+{
+    ScopedLock<Mutex> lock(_sendMutex);
+    return _outputOwner == ThisThread::get_id();
+}
+
+/*
+    routes of the current request, valid until the request is done. Only the thread that handles the
+    request uses the hazard pointer, so the routes are not public
+*/
+const HttpRouteTable* ClientConnection::getRoutes()
+{
+    if (_routesInUse == nullptr) {
+        _server->acquireRoutes(this);                               // e.g. error response before the url was complete
+    }
+    return _routesInUse;
+}
+
+/*
+    the handler thread keeps the standard headers until the request is done. Other threads, e.g. a
+    websocket push or a response from a worker, must not touch that hazard pointer, they copy the
+    headers while the server holds them
+*/
+void ClientConnection::appendStandardHeaders(HttpHeaderWriter& writer)
+{
+    if (!isHandlerThread()) {
+        _server->appendStandardHeaders(writer);
+        return;
+    }
+
+    if (_headersInUse == nullptr) {
+        _server->acquireStandardHeaders(this);
+    }
+    writer.append(_headersInUse->data(), _headersInUse->length());
+}
+
+/*
+    request is done, the routes and standard headers may be deleted now
+*/
+void ClientConnection::releaseRoutes()
+{
+    _route = nullptr;
+    _staticRoute = nullptr;
+    if (_routesInUse) {
+        _server->releaseRoutes(this);
+    }
+    if (_headersInUse) {
+        _server->releaseStandardHeaders(this);
+    }
+}
+
+/*
+    switch to a large receive buffer, if one is available. Retained data is copied to the same
+    offset, so the views of the parsed request stay valid
+*/
+/*
+    @return false if the buffer is large already or no large buffer is free
+*/
+bool ClientConnection::growBuffer()
+{
+    HttpBufferPool& pool = _server->getBufferPool();
+    if (_recv_buffer_size >= pool.getLargeSize())
+        return false;
+
+    size_t size;
+    uint8_t* buffer = pool.alloc(pool.getLargeSize(), &size);
+    if (buffer == nullptr)
+        return false;
+
+    memcpy(buffer, _recv_buffer, _recv_len);
+    pool.free(_recv_buffer);
+    _recv_buffer = buffer;
+    _recv_buffer_size = size;
+    _request.set_buffer((const char*)_recv_buffer);
+    return true;
+}
+
+void ClientConnection::shrinkBuffer()
+{
+    HttpBufferPool& pool = _server->getBufferPool();
+    if ((_recv_buffer_size <= pool.getSmallSize()) || (_recv_len > pool.getSmallSize()))
+        return;
+
+    size_t size;
+    uint8_t* buffer = pool.alloc(0, &size);
+    if (buffer) {
+        memcpy(buffer, _recv_buffer, _recv_len);
+        pool.free(_recv_buffer);
+        _recv_buffer = buffer;
+        _recv_buffer_size = size;
+        _request.set_buffer((const char*)_recv_buffer);
     }
 }
 
 void ClientConnection::printRequestHeader()
 {
-    debug("[Http]Request came in: %s %s\n", http_method_str(_request.get_method()), _request.get_url().c_str());
+    HttpStringView url = _request.get_url_view();
+    debug("[Http]Request came in: %s %.*s\n", http_method_str(_request.get_method()), (int)url.length, url.data);
     
-    MapHeaderIterator it;
-    int i = 0;
-
-    for (it = _request.headers.begin(); it != _request.headers.end(); it++) {
-        debug("[%d] ", i);
-        debug(it->first.c_str());
-        debug(" : ");
-        debug(it->second.c_str());
-        debug("\n");
-        i++;
+    for (int i = 0; i < _request.get_header_count(); i++) {
+        HttpStringView name = _request.get_header_name(i);
+        HttpStringView value = _request.get_header_value(i);
+        debug("[%d] %.*s : %.*s\n", i, (int)name.length, name.data, (int)value.length, value.data);
     }
     fflush(stdout);
 }
@@ -205,25 +658,14 @@ void ClientConnection::printRequestHeader()
 void ClientConnection::handleUpgradeRequest() {
     //HttpResponseBuilder builder(101);
     
-    MapHeaderIterator it;
-
-    bool upgradeWebsocketfound = false;
-    it = _request.headers.find("Upgrade");
-    if (it != _request.headers.end() && (it->second == "websocket")) {
-        upgradeWebsocketfound = true;
-    }
-
-    string secWebsocketKey;
-    it = _request.headers.find("Sec-WebSocket-Key");
-    if (it != _request.headers.end()) {
-        secWebsocketKey = it->second;
-    }
+    bool upgradeWebsocketfound = _request.get_header(HTTP_HEADER_UPGRADE).equalsIgnoreCase("websocket");
+    HttpStringView secWebsocketKey = _request.get_header(HTTP_HEADER_SEC_WEBSOCKET_KEY);
 
-    CreateWSHandlerFn createFn = _server->getWSHandler(_request.get_url().c_str());
+    CreateWSHandlerFn createFn = _routesInUse ? _routesInUse->findWSHandler(&_request) : nullptr;
 
     if (upgradeWebsocketfound && !secWebsocketKey.empty() && createFn) {        // neccessary header keys found and handler available
         if (_server->isWebsocketAvailable()) {                                  // Websockets available?
-            _isWebSocket = sendUpgradeResponse(secWebsocketKey.c_str());        // do upgrade handshake
+            _isWebSocket = sendUpgradeResponse(secWebsocketKey);                // do upgrade handshake
 
             if (_isWebSocket && createFn) {                                     // if upgrade successful
                 _server->incWebsocketCount();
@@ -236,22 +678,188 @@ void ClientConnection::handleUpgradeRequest() {
     }
 }
 
-nsapi_size_or_error_t ClientConnection::send(const char* buffer, size_t len)
+/*
+    write to the socket, waits until all data is accepted by the stack.
+    In event driven mode this blocks the event thread and all other connections of its queue, so the wait
+    for a slow client is limited to event-send-timeout. After a failed send the response is incomplete,
+    further output is dropped and the connection is closed after the current receive.
+*/
+nsapi_size_or_error_t ClientConnection::sendRaw(const char* buffer, size_t len)
 {
+    if (_sendError < 0)
+        return _sendError;
+
+    auto deadline = Kernel::Clock::now() + milliseconds(HTTP_EVENT_SEND_TIMEOUT);
     size_t bytesSent = 0;
     while(bytesSent < len) {
         nsapi_size_or_error_t sent = _socket->send(buffer + bytesSent,  len - bytesSent);
         if (sent < 0) {
-            if (sent != NSAPI_ERROR_WOULD_BLOCK)
+            if (sent != NSAPI_ERROR_WOULD_BLOCK) {
+                _sendError = sent;
                 return sent;
-            else 
-                continue;
+            }
+            if (_eventQueue) {
+                // non-blocking socket, wait for sigio (buffer space)
+                auto now = Kernel::Clock::now();
+                if (now >= deadline) {
+                    debug("%s: send timeout, %d of %d bytes sent\n", _threadName, (int)bytesSent, (int)len);
+                    _sendError = NSAPI_ERROR_TIMEOUT;
+                    return _sendError;
+                }
+                _sigioFlags.wait_any_for(0x01, min(duration_cast<milliseconds>(deadline - now), milliseconds(100)));
+            }
+            continue;
         }
         bytesSent += sent;
     }
     return bytesSent;
 }
 
+nsapi_size_or_error_t ClientConnection::send(const char* buffer, size_t len)
+{
+    ScopedLock<Mutex> lock(_sendMutex);
+    nsapi_size_or_error_t ret = write(buffer, headOutputLength(buffer, len));
+    endForeignOutput();
+    return (ret < 0) ? ret : (nsapi_size_or_error_t)len;
+}
+
+nsapi_size_or_error_t ClientConnection::sendv(const HttpSendSegment* segments, int count)
+{
+    ScopedLock<Mutex> lock(_sendMutex);
+    size_t total = 0;
+
+    for (int i = 0; i < count; i++) {
+        const char* data = (const char*)segments[i].data;
+        nsapi_size_or_error_t ret = write(data, headOutputLength(data, segments[i].length));
+        if (ret < 0) {
+            endForeignOutput();
+            return ret;
+        }
+        total += segments[i].length;
+    }
+
+    if (!_corked) {
+        nsapi_size_or_error_t ret = flushBuffer();
+        endForeignOutput();
+        if (ret < 0)
+            return ret;
+    }
+    return total;
+}
+
+void ClientConnection::cork()
+{
+    ScopedLock<Mutex> lock(_sendMutex);
+    _corked = true;
+}
+
+nsapi_error_t ClientConnection::flush()
+{
+    ScopedLock<Mutex> lock(_sendMutex);
+    _corked = false;
+    nsapi_size_or_error_t ret = flushBuffer();
+    endForeignOutput();
+    return (ret < 0) ? ret : NSAPI_ERROR_OK;
+}
+
+/*
+    append data to the output buffer. The buffer is sent when it reaches the flush size (full when
+    corked), data that fills a segment by itself is sent directly. _sendMutex must be locked
+*/
+nsapi_size_or_error_t ClientConnection::write(const char* data, size_t length)
+{
+    if (_sendBuffer == nullptr && length > 0) {
+        _sendBuffer = _server->getSendBufferPool().alloc(0, &_sendBufferSize);
+        if (_sendBuffer == nullptr)
+            return sendRaw(data, length);                               // no buffer left, send unbuffered
+    }
+
+    size_t flushSize = _corked ? _sendBufferSize : min(_sendBufferSize, (size_t)HTTP_SEND_FLUSH_SIZE);
+    while (length > 0) {
+        if (_sendLen == 0 && length >= flushSize) {
+            return sendRaw(data, length);                               // fills a segment, no need to copy it
+        }
+
+        size_t n = min(length, _sendBufferSize - _sendLen);
+        memcpy(_sendBuffer + _sendLen, data, n);
+        _sendLen += n;
+        data += n;
+        length -= n;
+        if (_sendLen >= flushSize) {
+            nsapi_size_or_error_t ret = flushBuffer();
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return NSAPI_ERROR_OK;
+}
+
+/*
+    bytes of data that are sent. The response to a HEAD request ends with the blank line after its
+    header, the body that a GET handler sends is reported as sent but dropped. _sendMutex must be locked
+*/
+size_t ClientConnection::headOutputLength(const char* data, size_t length)
+{
+    if (_headState < 0)
+        return length;
+
+    size_t n = 0;
+    while (n < length && _headState < 4) {
+        char expected = (_headState % 2 == 0) ? '\r' : '\n';
+        if (data[n] == expected)
+            _headState++;
+        else
+            _headState = (data[n] == '\r') ? 1 : 0;
+        n++;
+    }
+    return n;
+}
+
+/*
+    _sendMutex must be locked
+*/
+nsapi_size_or_error_t ClientConnection::flushBuffer()
+{
+    if (_sendLen == 0)
+        return 0;
+
+    nsapi_size_or_error_t ret = sendRaw((const char*)_sendBuffer, _sendLen);
+    _sendLen = 0;
+    return ret;
+}
+
+/*
+    output is complete, e.g. all responses for the received requests are written
+*/
+void ClientConnection::endOutput()
+{
+    ScopedLock<Mutex> lock(_sendMutex);
+    _corked = false;
+    releaseOutputBuffer();
+    _outputOwner = nullptr;
+}
+
+/*
+    send what is buffered and give the buffer back to the pool. _sendMutex must be locked
+*/
+void ClientConnection::releaseOutputBuffer()
+{
+    flushBuffer();
+    _server->getSendBufferPool().free(_sendBuffer);
+    _sendBuffer = nullptr;
+    _sendBufferSize = 0;
+}
+
+/*
+    output from another thread, e.g. a websocket push, has no endOutput() that sends it. Unless corked,
+    it is sent right away and does not keep a buffer from the pool. _sendMutex must be locked
+*/
+void ClientConnection::endForeignOutput()
+{
+    if (!_corked && _outputOwner != ThisThread::get_id())
+        releaseOutputBuffer();
+}
+
 bool ClientConnection::handleWebSocket(int size)
 {
 	uint8_t* ptr = _recv_buffer;
@@ -309,15 +917,15 @@ bool ClientConnection::handleWebSocket(int size)
     return false;
 }
 
-bool ClientConnection::sendUpgradeResponse(const char* key)
+bool ClientConnection::sendUpgradeResponse(HttpStringView key)
 {
 	char buf[128];
 
-	if (strlen(key) + sizeof(MAGIC_NUMBER) > sizeof(buf)) {
+	if (key.length + sizeof(MAGIC_NUMBER) > sizeof(buf)) {
 		return false;
 	}
-	strcpy(buf, key);
-	strcat(buf, MAGIC_NUMBER);
+	memcpy(buf, key.data, key.length);
+	strcpy(buf + key.length, MAGIC_NUMBER);
 
     uint8_t hash[20];
     mbedtls_sha1((const unsigned char*)buf, strlen(buf), hash);
@@ -476,15 +1084,14 @@ bool ClientConnection::sendFrame( WSopcode_t opcode, const uint8_t * payload, in
 
     createHeader(header, opcode, length, maskKey, fin);
 
-    if(send((const char*)header, headerSize) != headerSize) {       // send header
+    // header and payload in one segment
+    HttpSendSegment segments[] = {
+        { header, (size_t)headerSize },
+        { payload, (payload && length > 0) ? (size_t)length : 0 }
+    };
+    if(sendv(segments, 2) != (nsapi_size_or_error_t)(headerSize + segments[1].length)) {
         ret = false;
     }
 
-    if(payload && length > 0) {
-        if(send((const char*)payload, length) != length) {       // send payload
-            ret = false;
-        }
-    }
-
     return ret;
 }
@@ -28,9 +28,18 @@
 #include "HttpParsedRequest.h"
 #include "WebSocketHandler.h"
 #include "HTTPHandler.h"
+#include "HttpRouter.h"
+#include "HttpFileReader.h"
+#include "HttpHeaderWriter.h"
 #include <string>
 #include <map>
 
+// room for the chunk size line in front of the chunk data, "FFFFFFFF\r\n"
+#define HTTP_CHUNK_HEADER_SIZE      10
+
+// streamed response: size line, chunk-size bytes of content, CRLF
+#define HTTP_CHUNK_BUFFER_SIZE      (HTTP_CHUNK_HEADER_SIZE + HTTP_CHUNK_SIZE + 2)
+
 using namespace std::chrono;
 
 // Websocket defines
@@ -49,48 +58,163 @@ typedef enum {
 //typedef HttpResponse ParsedHttpRequest;
 class HttpServer;
 
+/**
+ * \brief per connection statistics, counters since start of the server
+ */
+struct ClientConnectionStats {
+    uint32_t connections;           // sockets handled
+    uint32_t requests;              // HTTP requests handled
+    uint32_t keepAliveRequests;     // requests that reused an open connection
+    uint32_t idleTimeouts;          // connections closed by keep-alive timeout
+    uint32_t bytesReceived;
+    uint32_t filesSent;             // files sent from the file system by HttpResponseBuilder
+    uint32_t fileBytesSent;
+    uint32_t fileSendTime;          // ms, throughput is fileBytesSent / fileSendTime
+};
+
+// one piece of a response for ClientConnection::sendv()
+struct HttpSendSegment {
+    const void* data;
+    size_t length;
+};
+
 class ClientConnection {
 public:
-    ClientConnection(HttpServer* server, const char* name);
+    /**
+     * ClientConnection Constructor
+     *
+     * @param[in] server        owning HttpServer
+     * @param[in] name          name for debug output and worker thread
+     * @param[in] eventQueue    if set, the connection runs event driven (non-blocking socket, sigio) on this
+     *                          queue and no worker thread is started. If nullptr, a worker thread is used.
+    */
+    ClientConnection(HttpServer* server, const char* name, EventQueue* eventQueue = nullptr);
     ~ClientConnection();
 
-    void start(TCPSocket* socket);
-    bool isIdle() {return !_socketIsOpen; };
-
-    // HTTP send
+    // @return false if there is no receive buffer, the socket is closed then
+    bool start(TCPSocket* socket);
+    bool isIdle() {return !core_util_atomic_load_bool(&_socketIsOpen); };
+
+    /**
+     * HTTP send. Small writes are collected in an output buffer, which is sent when it reaches
+     * send-flush-size and after the handlers for the received requests returned.
+     * Called from another thread outside of a handler, the data is sent right away unless corked.
+     *
+     * @return bytes sent or error
+     */
     nsapi_size_or_error_t send(const char* buffer, size_t len);
 
+    /**
+     * send several buffers, e.g. header and body, and flush unless corked. Small segments are
+     * copied into the output buffer, so a short response leaves in a single TCP segment.
+     *
+     * @return bytes sent or error
+     */
+    nsapi_size_or_error_t sendv(const HttpSendSegment* segments, int count);
+
+    // hold back output until flush() or until the output buffer is full
+    void cork();
+    nsapi_error_t flush();
+
     // Websocket functions
     bool sendFrame(WSopcode_t opcode, const uint8_t * payload = NULL, int length = 0, bool fin = true);
 
     HttpServer* getServer() { return _server; };
+    HttpParsedRequest* getRequest() { return &_request; };         // request that is handled
     void setWSTimer(milliseconds cycleTime) {_wsTimerCycle = cycleTime;};
     const char* getThreadname() { return _threadName; };
     bool isWebSocket() { return _isWebSocket; };
+
+    // keep-alive state of the current request, used for the Connection response header
+    bool isKeepAlive() { return _keepAlive; };
+    void setKeepAlive(bool keepAlive) { _keepAlive = keepAlive; };
+    int getRemainingRequests() { return HTTP_KEEPALIVE_MAX_REQUESTS - _requestCount; };
+    const ClientConnectionStats& getStats() { return _stats; };
+    void countFileSent(size_t bytes, microseconds duration);
+
+    // reads files ahead while they are sent, see HttpResponseBuilder::sendHeaderAndFile()
+    HttpFileReader& getFileReader() { return _fileReader; };
+
+    // standard headers of the server for a response, from any thread
+    void appendStandardHeaders(HttpHeaderWriter& writer);
     void textWs(const char* url, const char* text, int length);
 
 private:
+    friend class HttpServer;
+    void setIdle() { core_util_atomic_store_bool(&_socketIsOpen, false); };
     void receiveData();
+    void onSigio();
+    void processEvents();
+    void onTick();
+    nsapi_size_or_error_t receive();
+    void handleReceived(nsapi_size_or_error_t recv_ret);
+    bool handleRequests();
+    nsapi_size_or_error_t sendRaw(const char* buffer, size_t len);
+    nsapi_size_or_error_t write(const char* data, size_t length);
+    nsapi_size_or_error_t flushBuffer();
+    size_t headOutputLength(const char* data, size_t length);
+    void endOutput();
+    void releaseOutputBuffer();
+    void endForeignOutput();
+    bool isHandlerThread();
+    const HttpRouteTable* getRoutes();
+    void onUrlComplete();
+    void releaseRoutes();
+    bool onHeadersComplete();
+    void onBodyChunk(const char *at, uint32_t length);
+    void endBody(bool complete);
+    void releaseBodyArena();
+    void sendError(uint16_t statusCode);
+    bool growBuffer();
+    void shrinkBuffer();
+    void closeConnection();
+    void releaseIfClosed();
     bool handleWebSocket(int size);
     void handleUpgradeRequest();
-    bool sendUpgradeResponse(const char* key);
+    bool sendUpgradeResponse(HttpStringView key);
     void printRequestHeader();
     uint8_t createHeader(uint8_t * buf, WSopcode_t opcode, size_t length, uint8_t maskKey[4], bool fin);
     bool sendFrameHeader(WSopcode_t opcode, int length = 0, bool fin = true);
 
     const char* _threadName;
     bool _socketIsOpen;
+    ClientConnection* _nextIdle;                // link in the HttpServer idle list
+    bool _releasePending;                       // closed, to be released when the receive loop is left
     HttpServer* _server;
     TCPSocket* _socket;
     Thread  _threadClientConnection;
+    EventQueue* _eventQueue;
+    EventFlags _sigioFlags;
+    bool _eventPending;
     HttpParsedRequest  _request;
     HttpRequestParser _parser;
     bool _isWebSocket;
     bool _mPrevFin;
-    uint8_t _recv_buffer[HTTP_RECEIVE_BUFFER_SIZE];
-    CallbackRequestHandler _handler;
+    uint8_t* _recv_buffer;                      // from HttpServer buffer pool while connected
+    size_t _recv_buffer_size;
+    size_t _recv_len;                           // bytes in _recv_buffer
+    size_t _parse_pos;                          // bytes in _recv_buffer already passed to the parser
+    Mutex _sendMutex;                           // handler and other threads (websocket) may send
+    uint8_t* _sendBuffer;                       // output buffer from the pool while there is output
+    size_t _sendBufferSize;
+    size_t _sendLen;                            // bytes in _sendBuffer
+    bool _corked;
+    int _headState;                             // HEAD response: bytes of the blank line seen, body is dropped after it. -1 for other requests
+    osThreadId_t _outputOwner;                  // thread in handleReceived(), its output is flushed by endOutput()
+    nsapi_error_t _sendError;                   // first send error of the connection, no more output after it
+    const HTTPRoute* _route;                    // route for the current request
+    const HttpStaticRoute* _staticRoute;        // or compiled in route
+    const HttpRouteTable* _routesInUse;         // hazard pointer, routes of the current request
+    const std::string* _headersInUse;           // hazard pointer, standard headers of the current request
+    bool _streamBody;                           // body of the current request goes to the route body handler
+    int _errorStatus;                           // response status when the request was rejected while parsing
+    uint8_t* _bodyArena;                        // buffered body of the current request, from the body pool
     WebSocketHandler* _webSocketHandler;
-    Timer _timerWSTimeout;
+    Timer _timerIdle;                           // time since last activity, for websocket and keep-alive timeout
+    int _requestCount;                          // requests on this connection
+    bool _keepAlive;
+    ClientConnectionStats _stats;
+    HttpFileReader _fileReader;
     milliseconds _wsTimerCycle;
     std::string _wsOrigin;
 };
@@ -1,12 +1,38 @@
 #ifndef __HTTP_Handler__
 #define __HTTP_Handler__
 
-#include <map>
+#include "mbed.h"
+#include "HttpParsedRequest.h"
+#include "WebSocketHandler.h"
 
-class HttpParsedRequest;
 class ClientConnection;
 
+typedef WebSocketHandler* (*CreateWSHandlerFn)();
+
 typedef Callback<void(HttpParsedRequest*, ClientConnection* )> CallbackRequestHandler;
-typedef std::map<std::string, CallbackRequestHandler> HTTPSocketHandlerContainer;
+
+// streaming request body: begin returns 0 to accept the body or a HTTP status code to reject the request
+typedef Callback<int(HttpParsedRequest*, ClientConnection* )> CallbackBodyBegin;
+typedef Callback<void(HttpParsedRequest*, const char* data, uint32_t length)> CallbackBodyChunk;
+typedef Callback<void(HttpParsedRequest*, ClientConnection* )> CallbackBodyEnd;
+typedef Callback<void(HttpParsedRequest*)> CallbackBodyAbort;
+
+struct HTTPBodyHandler {
+    CallbackBodyBegin begin;                // after the request headers (optional)
+    CallbackBodyChunk chunk;                // for each piece of body data, directly from the receive buffer
+    CallbackBodyEnd end;                    // after the last piece, before the request handler (optional)
+    CallbackBodyAbort abort;                // instead of end if the body is not complete, e.g. the connection was closed (optional)
+};
+
+// route method for handlers that accept all methods
+#define HTTP_ANY_METHOD     (-1)
+
+struct HTTPRoute {
+    int method;                             // http_method or HTTP_ANY_METHOD
+    CallbackRequestHandler handler;
+    HttpHeaderFilter headerFilter;          // request headers the handler reads
+    HTTPBodyHandler body;                   // if chunk is set, the body is streamed instead of buffered
+    CreateWSHandlerFn wsHandler;            // websocket route
+};
 
 #endif
\ No newline at end of file
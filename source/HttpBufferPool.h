@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __HttpBufferPool_h__
+#define __HttpBufferPool_h__
+
+#include "mbed.h"
+
+/**
+ * \brief pool of fixed size buffers in two size classes, shared by all client connections.
+ *
+ * Memory for all buffers is allocated once in init(), alloc() and free() only move buffers
+ * between the free lists, so there is no heap fragmentation at runtime.
+ */
+class HttpBufferPool {
+public:
+    HttpBufferPool()
+    {
+        _memory = nullptr;
+        _freeSmall = nullptr;
+        _freeLarge = nullptr;
+        _smallSize = 0;
+        _largeSize = 0;
+        _largeStart = nullptr;
+    }
+
+    ~HttpBufferPool()
+    {
+        delete[] _memory;
+    }
+
+    bool init(int nSmall, size_t smallSize, int nLarge, size_t largeSize)
+    {
+        // buffers are linked through their first bytes while free
+        smallSize = align(max(smallSize, sizeof(FreeBuffer)));
+        largeSize = align(max(largeSize, sizeof(FreeBuffer)));
+
+        _memory = new uint8_t[nSmall * smallSize + nLarge * largeSize];
+        if (_memory == nullptr)
+            return false;
+
+        _smallSize = smallSize;
+        _largeSize = largeSize;
+        _largeStart = _memory + nSmall * smallSize;
+
+        for (int i = 0; i < nSmall; i++) {
+            push(&_freeSmall, _memory + i * smallSize);
+        }
+        for (int i = 0; i < nLarge; i++) {
+            push(&_freeLarge, _largeStart + i * largeSize);
+        }
+        return true;
+    }
+
+    /**
+     * get a buffer with at least minSize bytes. A small buffer is preferred, a large one is
+     * used when minSize does not fit or no small buffer is left.
+     *
+     * @param[in]  minSize  requested size
+     * @param[out] size     real size of the returned buffer
+     * @return buffer or nullptr if no buffer is available
+     */
+    uint8_t* alloc(size_t minSize, size_t* size)
+    {
+        ScopedLock<Mutex> lock(_mutex);
+        uint8_t* buffer = nullptr;
+
+        if (minSize <= _smallSize) {
+            buffer = pop(&_freeSmall);
+            *size = _smallSize;
+        }
+        if (buffer == nullptr && minSize <= _largeSize) {
+            buffer = pop(&_freeLarge);
+            *size = _largeSize;
+        }
+        if (buffer == nullptr) {
+            *size = 0;
+        }
+        return buffer;
+    }
+
+    void free(uint8_t* buffer)
+    {
+        if (buffer == nullptr)
+            return;
+
+        ScopedLock<Mutex> lock(_mutex);
+        push((buffer < _largeStart) ? &_freeSmall : &_freeLarge, buffer);
+    }
+
+    size_t getSmallSize() { return _smallSize; };
+    size_t getLargeSize() { return _largeSize; };
+
+private:
+    struct FreeBuffer {
+        FreeBuffer* next;
+    };
+
+    static size_t align(size_t size)
+    {
+        return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    }
+
+    void push(FreeBuffer** list, uint8_t* buffer)
+    {
+        FreeBuffer* entry = (FreeBuffer*)buffer;
+        entry->next = *list;
+        *list = entry;
+    }
+
+    uint8_t* pop(FreeBuffer** list)
+    {
+        FreeBuffer* entry = *list;
+        if (entry) {
+            *list = entry->next;
+        }
+        return (uint8_t*)entry;
+    }
+
+    Mutex _mutex;
+    uint8_t* _memory;
+    uint8_t* _largeStart;
+    FreeBuffer* _freeSmall;
+    FreeBuffer* _freeLarge;
+    size_t _smallSize;
+    size_t _largeSize;
+};
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __HttpDate_h__
+#define __HttpDate_h__
+
+#include "mbed.h"
+#include "platform/mbed_mktime.h"
+#include "HttpStringView.h"
+
+// "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_LENGTH        29
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+#define HTTP_DATE_LINE_LENGTH   37
+
+static const char* const httpDayNames[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char* const httpMonthNames[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/**
+ * format t as RFC 7231 IMF-fixdate
+ *
+ * @param[out] buffer  at least HTTP_DATE_LENGTH + 1 bytes
+ * @return length, 0 if t is invalid
+ */
+inline size_t httpFormatDate(time_t t, char* buffer)
+{
+    struct tm tm;
+    if (!_rtc_localtime(t, &tm, RTC_FULL_LEAP_YEAR_SUPPORT))
+        return 0;
+
+    int n = snprintf(buffer, HTTP_DATE_LENGTH + 1, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                     httpDayNames[tm.tm_wday], tm.tm_mday, httpMonthNames[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    return (n == HTTP_DATE_LENGTH) ? n : 0;
+}
+
+/**
+ * parse a RFC 7231 IMF-fixdate, e.g. of If-Modified-Since. The obsolete formats are not supported.
+ *
+ * @return false if s is not a valid date
+ */
+inline bool httpParseDate(HttpStringView s, time_t* t)
+{
+    if (s.length != HTTP_DATE_LENGTH || s.data[3] != ',' || !HttpStringView(s.data + 25, 4).equals(" GMT"))
+        return false;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    HttpStringView month(s.data + 8, 3);
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; i++) {
+        if (month.equals(httpMonthNames[i]))
+            tm.tm_mon = i;
+    }
+    tm.tm_mday = HttpStringView(s.data + 5, 2).toUInt();
+    tm.tm_year = HttpStringView(s.data + 12, 4).toUInt() - 1900;
+    tm.tm_hour = HttpStringView(s.data + 17, 2).toUInt();
+    tm.tm_min = HttpStringView(s.data + 20, 2).toUInt();
+    tm.tm_sec = HttpStringView(s.data + 23, 2).toUInt();
+    if (tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+        return false;
+
+    return _rtc_maketime(&tm, t, RTC_FULL_LEAP_YEAR_SUPPORT);
+}
+
+/**
+ * \brief the Date response header line (RFC 7231 IMF-fixdate), formatted at most once per second.
+ *
+ * The line is only available when the RTC was set, e.g. by NTP. Without a valid clock responses
+ * are sent without Date, as allowed for servers without a reasonable clock.
+ */
+class HttpDateCache {
+public:
+    HttpDateCache()
+    {
+        _time = 0;
+        _length = 0;
+    }
+
+    /**
+     * copy the current date line to buffer
+     *
+     * @param[out] buffer  at least HTTP_DATE_LINE_LENGTH bytes
+     * @return length of the line, 0 if the clock is not set
+     */
+    size_t get(char* buffer)
+    {
+        time_t now = time(nullptr);
+        if (now < MIN_VALID_TIME)
+            return 0;
+
+        ScopedLock<Mutex> lock(_mutex);
+        if (now != _time) {
+            format(now);
+        }
+        memcpy(buffer, _line, _length);
+        return _length;
+    }
+
+private:
+    void format(time_t now)
+    {
+        memcpy(_line, "Date: ", 6);
+        _length = 0;
+        if (httpFormatDate(now, _line + 6) > 0) {
+            memcpy(_line + 6 + HTTP_DATE_LENGTH, "\r\n", 2);
+            _length = HTTP_DATE_LINE_LENGTH;
+        }
+        _time = now;
+    }
+
+    // 2020-01-01, earlier times are an unset RTC
+    static const time_t MIN_VALID_TIME = 1577836800;
+
+    Mutex _mutex;
+    time_t _time;
+    char _line[HTTP_DATE_LINE_LENGTH + 1];          // + 1 for the terminator of httpFormatDate()
+    size_t _length;
+};
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "HttpFileCache.h"
+#include "HttpStringView.h"
+
+HttpFileCache::HttpFileCache(size_t budget, size_t maxFileSize)
+{
+    _budget = budget;
+    _maxFileSize = maxFileSize;
+    _used = 0;
+    _head = nullptr;
+    _tail = nullptr;
+    _hits = 0;
+    _misses = 0;
+    for (HashSlot& slot : _hashes) {
+        slot.fs = nullptr;
+    }
+}
+
+HttpFileCache::~HttpFileCache()
+{
+    clear();
+}
+
+const HttpFileCacheEntry* HttpFileCache::acquire(FileSystem* fs, const char* path, const struct stat& st)
+{
+    uint32_t hash = HttpStringView(path).hash();
+    ScopedLock<Mutex> lock(_mutex);
+
+    HttpFileCacheEntry* entry = find(fs, path, hash);
+    if (entry && (entry->fileSize != st.st_size || entry->mtime != st.st_mtime)) {
+        unlink(entry);                                      // file was changed
+        unref(entry);
+        entry = nullptr;
+    }
+    if (entry == nullptr) {
+        _misses++;
+        return nullptr;
+    }
+
+    if (entry != _head) {
+        unlink(entry);
+        linkFront(entry);
+    }
+
+    _hits++;
+    entry->_refCount++;
+    return entry;
+}
+
+void HttpFileCache::release(const HttpFileCacheEntry* entry)
+{
+    if (entry == nullptr)
+        return;
+
+    ScopedLock<Mutex> lock(_mutex);
+    unref((HttpFileCacheEntry*)entry);
+}
+
+HttpFileCacheEntry* HttpFileCache::create(FileSystem* fs, const char* path, const struct stat& st, const std::string& header)
+{
+    if (_budget == 0 || (size_t)st.st_size > _maxFileSize)
+        return nullptr;
+
+    size_t memorySize = header.length() + st.st_size;
+    if (memorySize > _budget)
+        return nullptr;
+
+    HttpFileCacheEntry* entry = new HttpFileCacheEntry();
+    uint8_t* memory = new uint8_t[memorySize];
+    if (entry == nullptr || memory == nullptr) {
+        delete entry;
+        delete[] memory;
+        return nullptr;
+    }
+
+    memcpy(memory, header.data(), header.length());
+    entry->fs = fs;
+    entry->path = path;
+    entry->pathHash = HttpStringView(path).hash();
+    entry->fileSize = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->header = (const char*)memory;
+    entry->headerLength = header.length();
+    entry->content = memory + header.length();
+    entry->contentLength = st.st_size;
+    entry->_memory = memory;
+    entry->_memorySize = memorySize;
+    entry->_refCount = 1;
+    entry->_prev = nullptr;
+    entry->_next = nullptr;
+    return entry;
+}
+
+void HttpFileCache::add(HttpFileCacheEntry* entry)
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    HttpFileCacheEntry* old = find(entry->fs, entry->path.c_str(), entry->pathHash);
+    if (old) {
+        unlink(old);
+        unref(old);
+    }
+
+    // evict least recently used entries
+    while (_tail && (_used + entry->_memorySize > _budget)) {
+        HttpFileCacheEntry* lru = _tail;
+        unlink(lru);
+        unref(lru);
+    }
+
+    linkFront(entry);
+    entry->_refCount++;                                     // reference of the cache
+}
+
+void HttpFileCache::discard(HttpFileCacheEntry* entry)
+{
+    delete[] entry->_memory;
+    delete entry;
+}
+
+bool HttpFileCache::findHash(FileSystem* fs, const char* path, off_t fileSize, uint32_t* hash)
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    HashSlot& slot = hashSlot(path);
+    if (slot.fs != fs || slot.fileSize != fileSize || slot.path != path)
+        return false;
+    *hash = slot.hash;
+    return true;
+}
+
+void HttpFileCache::storeHash(FileSystem* fs, const char* path, off_t fileSize, uint32_t hash)
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    HashSlot& slot = hashSlot(path);
+    slot.fs = fs;
+    slot.path = path;
+    slot.fileSize = fileSize;
+    slot.hash = hash;
+}
+
+void HttpFileCache::invalidate(FileSystem* fs, const char* path)
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    HashSlot& slot = hashSlot(path);
+    if (slot.fs == fs && slot.path == path)
+        slot.fs = nullptr;
+
+    HttpFileCacheEntry* entry = find(fs, path, HttpStringView(path).hash());
+    if (entry) {
+        unlink(entry);
+        unref(entry);
+    }
+}
+
+void HttpFileCache::clear()
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    while (_head) {
+        HttpFileCacheEntry* entry = _head;
+        unlink(entry);
+        unref(entry);
+    }
+    for (HashSlot& slot : _hashes) {
+        slot.fs = nullptr;
+    }
+}
+
+/*
+    _mutex must be locked
+*/
+HttpFileCache::HashSlot& HttpFileCache::hashSlot(const char* path)
+{
+    return _hashes[HttpStringView(path).hash() % HTTP_ETAG_TABLE_SIZE];
+}
+
+/*
+    _mutex must be locked
+*/
+HttpFileCacheEntry* HttpFileCache::find(FileSystem* fs, const char* path, uint32_t hash)
+{
+    for (HttpFileCacheEntry* entry = _head; entry; entry = entry->_next) {
+        if (entry->pathHash == hash && entry->fs == fs && entry->path == path) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+/*
+    remove from the LRU list, the caller drops the reference of the cache. _mutex must be locked
+*/
+void HttpFileCache::unlink(HttpFileCacheEntry* entry)
+{
+    if (entry->_prev)
+        entry->_prev->_next = entry->_next;
+    else
+        _head = entry->_next;
+    if (entry->_next)
+        entry->_next->_prev = entry->_prev;
+    else
+        _tail = entry->_prev;
+    entry->_prev = nullptr;
+    entry->_next = nullptr;
+    _used -= entry->_memorySize;
+}
+
+/*
+    insert as most recently used. _mutex must be locked
+*/
+void HttpFileCache::linkFront(HttpFileCacheEntry* entry)
+{
+    entry->_prev = nullptr;
+    entry->_next = _head;
+    if (_head)
+        _head->_prev = entry;
+    _head = entry;
+    if (_tail == nullptr)
+        _tail = entry;
+    _used += entry->_memorySize;
+}
+
+/*
+    _mutex must be locked
+*/
+void HttpFileCache::unref(HttpFileCacheEntry* entry)
+{
+    if (--entry->_refCount == 0) {
+        discard(entry);
+    }
+}
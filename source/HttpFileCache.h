@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __HttpFileCache_h__
+#define __HttpFileCache_h__
+
+#include "mbed.h"
+#include <string>
+
+/**
+ * \brief cached file: file specific response header lines and the file contents
+ */
+struct HttpFileCacheEntry {
+    FileSystem* fs;
+    std::string path;
+    uint32_t pathHash;
+    off_t fileSize;                         // for validation with stat()
+    time_t mtime;
+    std::string etag;                       // validator, set before the entry is added
+    const char* header;                     // "Key:Value\r\n" lines, e.g. Content-Type
+    size_t headerLength;
+    uint8_t* content;
+    size_t contentLength;
+
+private:
+    friend class HttpFileCache;
+    uint8_t* _memory;                       // header and content
+    size_t _memorySize;
+    int _refCount;                          // users, plus one while in the cache
+    HttpFileCacheEntry* _prev;              // LRU list, most recently used first
+    HttpFileCacheEntry* _next;
+};
+
+/**
+ * \brief LRU cache for small static files, limited by a byte budget.
+ *
+ * Entries are validated against the file size and modification time on every lookup. File systems
+ * that do not keep modification times (e.g. FAT and LittleFS in mbed OS report 0) only detect size
+ * changes, call invalidate() after writing such a file.
+ * Entries are reference counted, an entry that is evicted while a response is sent from it is
+ * deleted after release().
+ */
+class HttpFileCache {
+public:
+    /**
+     * @param[in] budget        max. bytes for all entries, 0 disables the cache
+     * @param[in] maxFileSize   larger files are not cached
+     */
+    HttpFileCache(size_t budget, size_t maxFileSize);
+    ~HttpFileCache();
+
+    bool isEnabled() { return _budget > 0; };
+
+    /**
+     * get a valid entry for the file, the caller must release() it
+     *
+     * @param[in]  st  stat() result of the file
+     * @return entry or nullptr if the file is not cached or was changed
+     */
+    const HttpFileCacheEntry* acquire(FileSystem* fs, const char* path, const struct stat& st);
+    void release(const HttpFileCacheEntry* entry);
+
+    /**
+     * new entry for a file that is not cached yet, the caller fills in the content and calls add().
+     *
+     * @param[in] header  file specific response header lines
+     * @return entry or nullptr if the file is too large
+     */
+    HttpFileCacheEntry* create(FileSystem* fs, const char* path, const struct stat& st, const std::string& header);
+
+    /**
+     * insert a filled entry, it replaces an older entry for the same file. Least recently used
+     * entries are evicted to stay within the budget. The caller must release() the entry.
+     */
+    void add(HttpFileCacheEntry* entry);
+
+    // drop a created entry that could not be filled
+    void discard(HttpFileCacheEntry* entry);
+
+    /**
+     * content hash of a file without modification time, for its ETag. Hashes are kept in a small
+     * table for files that are not cached, too. A hash is valid as long as the file size is the same.
+     *
+     * @return false if no hash is known for this size of the file
+     */
+    bool findHash(FileSystem* fs, const char* path, off_t fileSize, uint32_t* hash);
+    void storeHash(FileSystem* fs, const char* path, off_t fileSize, uint32_t hash);
+
+    // remove the file from the cache, e.g. after it was written
+    void invalidate(FileSystem* fs, const char* path);
+    void clear();
+
+    uint32_t getHits() { return _hits; };
+    uint32_t getMisses() { return _misses; };
+    size_t getUsed() { return _used; };
+
+private:
+    HttpFileCacheEntry* find(FileSystem* fs, const char* path, uint32_t hash);
+    void unlink(HttpFileCacheEntry* entry);
+    void linkFront(HttpFileCacheEntry* entry);
+    void unref(HttpFileCacheEntry* entry);
+
+    struct HashSlot {
+        FileSystem* fs;                     // nullptr if unused
+        std::string path;
+        off_t fileSize;
+        uint32_t hash;
+    };
+    HashSlot& hashSlot(const char* path);
+
+    Mutex _mutex;
+    size_t _budget;
+    size_t _maxFileSize;
+    size_t _used;
+    HttpFileCacheEntry* _head;
+    HttpFileCacheEntry* _tail;
+    uint32_t _hits;
+    uint32_t _misses;
+    HashSlot _hashes[HTTP_ETAG_TABLE_SIZE];     // by path hash, a newer file takes the slot
+};
+
+#endif
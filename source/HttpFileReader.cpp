@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "HttpFileReader.h"
+
+#define FLAG_IDLE   0x01
+
+// throughput is compared after this many chunks were sent with one size
+#define CHUNK_SAMPLE_COUNT      16
+
+// largest chunk
+#define CHUNK_MAX_SIZE          ((HTTP_TCP_SEND_WINDOW > 0) ? std::min(HTTP_FILE_READ_BUFFER_SIZE, HTTP_TCP_SEND_WINDOW) : HTTP_FILE_READ_BUFFER_SIZE)
+
+HttpChunkSizer::HttpChunkSizer()
+{
+    memset(_fileSystems, 0, sizeof(_fileSystems));
+    memset(_blockSizes, 0, sizeof(_blockSizes));
+    _blockSize = 0;
+    _chunkSize = CHUNK_MAX_SIZE;
+    _direction = -1;
+    _sampleBytes = 0;
+    _sampleTime = 0;
+    _throughput = 0;
+}
+
+size_t HttpChunkSizer::getChunkSize(FileSystem* fs)
+{
+    ScopedLock<Mutex> lock(_mutex);
+    _blockSize = getBlockSize(fs);
+    return alignChunkSize(_blockSize);
+}
+
+void HttpChunkSizer::report(FileSystem* fs, size_t chunkSize, size_t bytes, microseconds duration)
+{
+    ScopedLock<Mutex> lock(_mutex);
+
+    // small files say little about the chunk size, other sizes would spoil the sample
+    if (bytes < 2 * chunkSize || chunkSize != alignChunkSize(getBlockSize(fs)))
+        return;
+
+    _sampleBytes += bytes;
+    _sampleTime += duration.count();
+    if (_sampleBytes < CHUNK_SAMPLE_COUNT * chunkSize || _sampleTime == 0)
+        return;
+
+    // hill climbing: keep the direction while it gets faster, turn around when it gets slower
+    uint32_t throughput = (uint32_t)(_sampleBytes * 1000000 / _sampleTime);
+    if (throughput < _throughput)
+        _direction = -_direction;
+    _throughput = throughput;
+    _sampleBytes = 0;
+    _sampleTime = 0;
+
+    size_t step = std::min(std::max(_blockSize, (size_t)512), (size_t)CHUNK_MAX_SIZE);
+    if (_direction > 0 && chunkSize + step <= CHUNK_MAX_SIZE) {
+        _chunkSize = chunkSize + step;
+    } else if (_direction < 0 && chunkSize >= 2 * step) {
+        _chunkSize = chunkSize - step;
+    } else {
+        _direction = -_direction;                       // at the limit, try the other way next time
+    }
+}
+
+void HttpChunkSizer::getStats(size_t* blockSize, size_t* chunkSize, uint32_t* throughput)
+{
+    ScopedLock<Mutex> lock(_mutex);
+    *blockSize = _blockSize;
+    *chunkSize = _chunkSize;
+    *throughput = _throughput;
+}
+
+/*
+    current chunk size for a file system with blockSize. _mutex must be locked
+*/
+size_t HttpChunkSizer::alignChunkSize(size_t blockSize)
+{
+    // blocks larger than a buffer can't be aligned
+    if (blockSize > CHUNK_MAX_SIZE)
+        return CHUNK_MAX_SIZE;
+    return std::max(_chunkSize / blockSize, (size_t)1) * blockSize;
+}
+
+/*
+    _mutex must be locked
+*/
+size_t HttpChunkSizer::getBlockSize(FileSystem* fs)
+{
+    int i = 0;
+    for (; i < MAX_FILESYSTEMS && _fileSystems[i]; i++) {
+        if (_fileSystems[i] == fs)
+            return _blockSizes[i];
+    }
+
+    struct statvfs st;
+    size_t blockSize = 512;
+    if (fs->statvfs("/", &st) == 0 && st.f_bsize > 0)
+        blockSize = st.f_bsize;
+    if (i < MAX_FILESYSTEMS) {
+        _fileSystems[i] = fs;
+        _blockSizes[i] = blockSize;
+    }
+    return blockSize;
+}
+
+
+HttpFileReader::HttpFileReader()
+{
+    _queue = nullptr;
+    _file = nullptr;
+    _memory = nullptr;
+    _head = 0;
+    _tail = 0;
+    _count = 0;
+    _position = 0;
+    _remaining = 0;
+    _chunkSize = HTTP_FILE_READ_BUFFER_SIZE;
+    _busy = false;
+    _failed = false;
+}
+
+HttpFileReader::~HttpFileReader()
+{
+    end();
+}
+
+void HttpFileReader::begin(EventQueue* queue, File* file, size_t offset, size_t length, size_t chunkSize, uint8_t* buffers)
+{
+    end();
+
+    _memory = buffers;
+    _queue = queue;
+    _file = file;
+    _head = 0;
+    _tail = 0;
+    _count = 0;
+    _position = offset;
+    _remaining = length;
+    _chunkSize = std::min(std::max(chunkSize, (size_t)1), (size_t)HTTP_FILE_READ_BUFFER_SIZE);
+    _failed = false;
+    _busy = (length > 0);
+    if (_busy)
+        schedule();
+}
+
+ssize_t HttpFileReader::next(const uint8_t** data)
+{
+    _mutex.lock();
+    bool done = (_count == 0) && (_remaining == 0 || _failed) && !_busy;
+    _mutex.unlock();
+    if (done || _file == nullptr)
+        return 0;
+
+    _filled.acquire();
+
+    ScopedLock<Mutex> lock(_mutex);
+    *data = _memory + _tail * HTTP_FILE_READ_BUFFER_SIZE;
+    return _lengths[_tail];
+}
+
+void HttpFileReader::release()
+{
+    _mutex.lock();
+    _tail = (_tail + 1) % HTTP_FILE_READ_BUFFER_COUNT;
+    _count--;
+    bool start = !_busy && (_remaining > 0) && !_failed;
+    if (start)
+        _busy = true;
+    _mutex.unlock();
+
+    if (start)
+        schedule();
+}
+
+void HttpFileReader::end()
+{
+    if (_file == nullptr)
+        return;
+
+    // wait until a running read is done, it uses the file and the buffers
+    _mutex.lock();
+    _remaining = 0;
+    if (_busy) {
+        _flags.clear(FLAG_IDLE);
+        _mutex.unlock();
+        _flags.wait_any(FLAG_IDLE);
+    } else {
+        _mutex.unlock();
+    }
+
+    // drop the tokens of unsent buffers
+    while (_filled.try_acquire()) {
+    }
+    _file = nullptr;
+    _memory = nullptr;
+}
+
+// read on the file reader thread, or directly if there is none or its queue is full
+void HttpFileReader::schedule()
+{
+    if (_queue == nullptr || _queue->call(this, &HttpFileReader::readNext) == 0)
+        readNext();
+}
+
+void HttpFileReader::readNext()
+{
+    _mutex.lock();
+    if (_count == HTTP_FILE_READ_BUFFER_COUNT || _remaining == 0 || _failed) {
+        _busy = false;
+        _flags.set(FLAG_IDLE);
+        _mutex.unlock();
+        return;
+    }
+    int index = _head;
+    size_t size = std::min(_remaining, _chunkSize - _position % _chunkSize);
+    _mutex.unlock();
+
+    ssize_t n = _file->read(_memory + index * HTTP_FILE_READ_BUFFER_SIZE, size);
+
+    _mutex.lock();
+    if (n != (ssize_t)size) {
+        debug("HttpFileReader: error reading file, size: %d read: %d errno: %d\n", size, n, errno);
+        _failed = true;
+        n = (n < 0) ? n : NSAPI_ERROR_DEVICE_ERROR;
+    } else {
+        _position += n;
+        _remaining -= n;
+    }
+    _lengths[index] = n;
+    _head = (_head + 1) % HTTP_FILE_READ_BUFFER_COUNT;
+    _count++;
+    _filled.release();
+    _mutex.unlock();
+
+    // one buffer per event, reads for other connections are not held up by a large file
+    schedule();
+}
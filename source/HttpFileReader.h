@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __HttpFileReader_h__
+#define __HttpFileReader_h__
+
+#include "mbed.h"
+
+using namespace std::chrono;
+
+// buffers of one reader, at least one (file-read-buffers 0 or 1: no read ahead)
+#define HTTP_FILE_READ_BUFFER_COUNT     ((HTTP_FILE_READ_BUFFERS > 1) ? HTTP_FILE_READ_BUFFERS : 1)
+
+/**
+ * \brief size of the file reads, tuned at runtime.
+ *
+ * Chunks are a multiple of the block size of the file system, so reads don't cover partial blocks,
+ * and not larger than file-read-buffer-size and the TCP send window (tcp-send-window). Within
+ * these limits the size climbs by one block in the direction that improved the throughput of the
+ * previous file sends.
+ */
+class HttpChunkSizer {
+public:
+    HttpChunkSizer();
+
+    // chunk size for reading from fs
+    size_t getChunkSize(FileSystem* fs);
+
+    // bytes of a file on fs that were read in chunkSize chunks and sent in duration. Reports for a
+    // chunk size that is no longer current, e.g. of a send that started before the last step, are ignored
+    void report(FileSystem* fs, size_t chunkSize, size_t bytes, microseconds duration);
+
+    // block size of the last file system, current chunk size and throughput at the last step
+    void getStats(size_t* blockSize, size_t* chunkSize, uint32_t* throughput);
+
+private:
+    size_t getBlockSize(FileSystem* fs);
+    size_t alignChunkSize(size_t blockSize);
+
+    static const int MAX_FILESYSTEMS = 4;
+
+    Mutex _mutex;
+    FileSystem* _fileSystems[MAX_FILESYSTEMS];     // block size is read once, statvfs may be slow
+    size_t _blockSizes[MAX_FILESYSTEMS];
+    size_t _blockSize;                              // of the last file system
+    size_t _chunkSize;                              // before alignment to the block size
+    int _direction;                                 // +1 or -1
+    uint64_t _sampleBytes;                          // sent with the current chunk size
+    uint64_t _sampleTime;                           // us
+    uint32_t _throughput;                           // bytes/s with the previous chunk size
+};
+
+/**
+ * \brief reads a file ahead of the sender, so file system latency and network transmission overlap.
+ *
+ * The file is read into a ring of file-read-buffers buffers on the file reader thread of the
+ * HttpServer while the connection sends the previous buffers. One reader belongs to each
+ * ClientConnection and is used for one range of a file at a time:
+ *
+ *     reader.begin(queue, &file, length);
+ *     while ((n = reader.next(&data)) > 0) {
+ *         send(data, n);
+ *         reader.release();
+ *     }
+ *     reader.end();
+ *
+ * Without queue the buffers are read in next() and release(), like a plain read loop.
+ */
+class HttpFileReader {
+public:
+    HttpFileReader();
+    ~HttpFileReader();
+
+    /**
+     * start reading length bytes from offset, the current position of file. Reads end on multiples
+     * of chunkSize (at most file-read-buffer-size), so they stay aligned to the blocks of the file system.
+     *
+     * @param[in] buffers  HTTP_FILE_READ_BUFFER_COUNT * file-read-buffer-size bytes, e.g. from
+     *                     HttpServer::getFileReadPool(), used until end()
+     */
+    void begin(EventQueue* queue, File* file, size_t offset, size_t length, size_t chunkSize, uint8_t* buffers);
+
+    /**
+     * wait for the next buffer
+     *
+     * @param[out] data     content of the buffer, valid until release()
+     * @return bytes in the buffer, 0 at the end or negative error of the file system
+     */
+    ssize_t next(const uint8_t** data);
+
+    // buffer of next() is sent, it can be read into again
+    void release();
+
+    // stop reading, the file can be used (seek, close) again after this
+    void end();
+
+private:
+    void schedule();
+    void readNext();
+
+    EventQueue* _queue;
+    File* _file;                            // nullptr if not reading
+    uint8_t* _memory;                       // HTTP_FILE_READ_BUFFER_COUNT buffers of the caller while reading
+    Mutex _mutex;                           // protects the state below
+    Semaphore _filled;                      // one token per filled buffer
+    EventFlags _flags;
+    ssize_t _lengths[HTTP_FILE_READ_BUFFER_COUNT];
+    int _head;                              // next buffer to read into
+    int _tail;                              // next buffer to send
+    int _count;                             // filled buffers
+    size_t _position;                       // file offset of the next read
+    size_t _remaining;                      // bytes not yet read
+    size_t _chunkSize;
+    bool _busy;                             // read is scheduled or running
+    bool _failed;
+};
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __HttpHeaderWriter_h__
+#define __HttpHeaderWriter_h__
+
+#include "mbed.h"
+#include <string>
+#include "HttpStringView.h"
+
+/**
+ * \brief headers of a response, kept as "Name: value\r\n" lines in a buffer of the caller.
+ *
+ * HttpResponseBuilder places the lines in its header buffer, behind the room for the status line,
+ * so they are sent without another copy and the builder itself stays small on the stack.
+ * Names and values are copied, headers["Name"] = value works as with the former std::map.
+ * Setting a header again replaces it. If the lines don't fit, overflowed() is true and the
+ * response header is not sent.
+ */
+class HttpResponseHeaders {
+public:
+    // value of headers["Name"], assigned values are copied
+    class Value {
+    public:
+        Value& operator=(HttpStringView value)
+        {
+            _headers->set(_name, value);
+            return *this;
+        }
+        Value& operator=(const char* value) { return *this = HttpStringView(value); }
+        Value& operator=(const std::string& value) { return *this = HttpStringView(value.data(), value.length()); }
+
+        operator std::string() const
+        {
+            HttpStringView value = _headers->get(_name);
+            return std::string(value.data ? value.data : "", value.length);
+        }
+
+    private:
+        friend class HttpResponseHeaders;
+        Value(HttpResponseHeaders* headers, HttpStringView name) : _headers(headers), _name(name) {}
+
+        HttpResponseHeaders* _headers;
+        HttpStringView _name;
+    };
+
+    HttpResponseHeaders() : _buffer(nullptr), _size(0), _length(0), _count(0), _overflow(false) {}
+
+    // lines are written to buffer, without buffer every set() overflows
+    void init(char* buffer, size_t size)
+    {
+        _buffer = buffer;
+        _size = buffer ? size : 0;
+        clear();
+    }
+
+    Value operator[](const char* name) { return Value(this, HttpStringView(name)); }
+    Value operator[](const std::string& name) { return Value(this, HttpStringView(name.data(), name.length())); }
+
+    bool set(const char* name, HttpStringView value) { return set(HttpStringView(name), value); }
+    bool set(const char* name, const char* value) { return set(HttpStringView(name), HttpStringView(value)); }
+
+    bool setNumber(const char* name, uint64_t number)
+    {
+        char digits[20];
+        size_t n = formatNumber(number, digits + sizeof(digits));
+        return set(HttpStringView(name), HttpStringView(digits + sizeof(digits) - n, n));
+    }
+
+    void erase(const char* name) { remove(name); }
+
+    void remove(const char* name) { remove(HttpStringView(name)); }
+
+    // value of the header, empty view (data nullptr) if it is not set
+    HttpStringView get(const char* name) const { return get(HttpStringView(name)); }
+
+    bool has(const char* name) const { return get(name).data != nullptr; }
+
+    void clear()
+    {
+        _length = 0;
+        _count = 0;
+        _overflow = false;
+    }
+
+    bool overflowed() const { return _overflow; };
+    int size() const { return _count; };
+
+    // the lines, in the order the headers were set
+    const char* data() const { return _buffer; };
+    size_t length() const { return _length; };
+
+    /**
+     * decimal digits of number, written backwards in front of end
+     * @return number of digits
+     */
+    static size_t formatNumber(uint64_t number, char* end)
+    {
+        char* p = end;
+        do {
+            *--p = (char)('0' + number % 10);
+            number /= 10;
+        } while (number > 0);
+        return end - p;
+    }
+
+private:
+    bool set(HttpStringView name, HttpStringView value)
+    {
+        remove(name);
+        size_t lineLength = name.length + 2 + value.length + 2;
+        if (lineLength > _size - _length) {
+            _overflow = true;
+            return false;
+        }
+        char* p = _buffer + _length;
+        memcpy(p, name.data, name.length);
+        p += name.length;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy(p, value.data, value.length);
+        p += value.length;
+        *p++ = '\r';
+        *p++ = '\n';
+        _length += lineLength;
+        _count++;
+        return true;
+    }
+
+    void remove(HttpStringView name)
+    {
+        size_t start, end;
+        if (findLine(name, &start, &end)) {
+            memmove(_buffer + start, _buffer + end, _length - end);
+            _length -= end - start;
+            _count--;
+        }
+    }
+
+    HttpStringView get(HttpStringView name) const
+    {
+        size_t start, end;
+        if (!findLine(name, &start, &end))
+            return HttpStringView();
+        size_t valueStart = start + name.length + 2;
+        return HttpStringView(_buffer + valueStart, end - 2 - valueStart);
+    }
+
+    // line of the header, start and end including CRLF
+    bool findLine(HttpStringView name, size_t* start, size_t* end) const
+    {
+        size_t pos = 0;
+        while (pos < _length) {
+            size_t lineEnd = pos;
+            while (_buffer[lineEnd] != '\n')
+                lineEnd++;
+            lineEnd++;
+            if ((lineEnd - pos > name.length) && (_buffer[pos + name.length] == ':') &&
+                HttpStringView(_buffer + pos, name.length).equalsIgnoreCase(name)) {
+                *start = pos;
+                *end = lineEnd;
+                return true;
+            }
+            pos = lineEnd;
+        }
+        return false;
+    }
+
+    char* _buffer;
+    size_t _size;
+    size_t _length;
+    int _count;
+    bool _overflow;
+};
+
+/**
+ * \brief serializes a response header into a fixed buffer, without heap allocation.
+ *
+ * Output that does not fit sets the overflow state, all further output is dropped and ok() is
+ * false. The buffer is not null terminated.
+ */
+class HttpHeaderWriter {
+public:
+    HttpHeaderWriter(char* buffer, size_t size) : _buffer(buffer), _size(size), _length(0), _overflow(false) {}
+
+    // HTTP/1.1 200 OK
+    void statusLine(uint16_t statusCode, const char* reason)
+    {
+        append("HTTP/1.1 ", 9);
+        appendNumber(statusCode);
+        append(" ", 1);
+        append(reason);
+        append("\r\n", 2);
+    }
+
+    void header(const char* name, HttpStringView value)
+    {
+        append(name);
+        append(": ", 2);
+        append(value.data, value.length);
+        append("\r\n", 2);
+    }
+
+    void header(const char* name, uint64_t number)
+    {
+        append(name);
+        append(": ", 2);
+        appendNumber(number);
+        append("\r\n", 2);
+    }
+
+    // empty line after the headers
+    void end()
+    {
+        append("\r\n", 2);
+    }
+
+    void append(const char* data, size_t length)
+    {
+        if (_overflow || length > _size - _length) {
+            _overflow = true;
+            return;
+        }
+        memcpy(_buffer + _length, data, length);
+        _length += length;
+    }
+
+    void append(const char* s)
+    {
+        append(s, s ? strlen(s) : 0);
+    }
+
+    void appendNumber(uint64_t number)
+    {
+        char digits[20];
+        size_t n = HttpResponseHeaders::formatNumber(number, digits + sizeof(digits));
+        append(digits + sizeof(digits) - n, n);
+    }
+
+    bool ok() const { return !_overflow; };
+    const char* data() const { return _buffer; };
+    size_t length() const { return _length; };
+
+private:
+    char* _buffer;
+    size_t _size;
+    size_t _length;
+    bool _overflow;
+};
+
+#endif
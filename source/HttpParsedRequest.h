@@ -18,18 +18,160 @@
 #ifndef _MBED_HTTP_HTTP_RESPONSE
 #define _MBED_HTTP_HTTP_RESPONSE
 #include <string>
+#include <vector>
 #include <map>
+#include <initializer_list>
 #include "../http_parser/http_parser.h"
+#include "HttpStringView.h"
 
 using namespace std;
 
+static_assert(HTTP_RECEIVE_BUFFER_SIZE <= 0xFFFF, "request views use 16 bit offsets");
+
+/*
+    (offset, length) of a string in the receive buffer. Offsets stay valid when the
+    connection moves the retained data to a larger buffer.
+*/
+struct HttpBufferSpan {
+    uint16_t offset;
+    uint16_t length;
+};
+
+/*
+    well known request headers, recognized once while parsing and accessible without lookup
+*/
+typedef enum {
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_SEC_WEBSOCKET_KEY,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_COUNT,
+    HTTP_HEADER_UNKNOWN = HTTP_HEADER_COUNT
+} HttpHeaderId;
+
+static const struct {
+    const char* name;
+    uint32_t hash;
+} httpWellKnownHeaders[HTTP_HEADER_COUNT] = {
+    { "Host",               HttpStringView::hashIgnoreCase("Host") },
+    { "Connection",         HttpStringView::hashIgnoreCase("Connection") },
+    { "Content-Length",     HttpStringView::hashIgnoreCase("Content-Length") },
+    { "Upgrade",            HttpStringView::hashIgnoreCase("Upgrade") },
+    { "Sec-WebSocket-Key",  HttpStringView::hashIgnoreCase("Sec-WebSocket-Key") },
+    { "Accept-Encoding",    HttpStringView::hashIgnoreCase("Accept-Encoding") },
+    { "If-None-Match",      HttpStringView::hashIgnoreCase("If-None-Match") },
+    { "Range",              HttpStringView::hashIgnoreCase("Range") },
+    { "If-Modified-Since",  HttpStringView::hashIgnoreCase("If-Modified-Since") },
+    { "If-Range",           HttpStringView::hashIgnoreCase("If-Range") },
+};
+
+/*
+    set of request headers a handler is interested in. Well known headers are always accepted,
+    they are used by the server itself. Without names all headers are accepted.
+*/
+class HttpHeaderFilter {
+public:
+    HttpHeaderFilter() : _acceptAll(true) {}
+
+    HttpHeaderFilter(std::initializer_list<const char*> names) : _acceptAll(false) {
+        _hashes.reserve(names.size());
+        for (const char* name : names) {
+            _hashes.push_back(HttpStringView(name).hashIgnoreCase());
+        }
+    }
+
+    // only the hash is compared, a collision lets an additional header through
+    bool accepts(int id, uint32_t hash) const {
+        if (_acceptAll || (id != HTTP_HEADER_UNKNOWN)) {
+            return true;
+        }
+        for (uint32_t h : _hashes) {
+            if (h == hash) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    bool _acceptAll;
+    vector<uint32_t> _hashes;
+};
+
+// path parameter captured by the router, the name belongs to the route
+struct HttpRouteParam {
+    const char* name;
+    HttpBufferSpan value;
+};
+
+struct HttpHeaderEntry {
+    HttpBufferSpan name;
+    HttpBufferSpan value;
+    uint32_t hash;                  // case insensitive hash of name
+    uint8_t id;                     // HttpHeaderId
+};
+
+// hash index with at least twice the entries of the header table, must be a power of 2
+static constexpr int httpHeaderIndexSize(int n = 1)
+{
+    return (n >= 2 * HTTP_MAX_HEADERS) ? n : httpHeaderIndexSize(2 * n);
+}
+static_assert(HTTP_MAX_HEADERS < 255, "header index uses 8 bit entries");
+
+class HttpParsedRequest;
+
 typedef map<string, string>  MapHeaders;
 typedef MapHeaders::iterator MapHeaderIterator;
 
+/**
+ * \brief compatibility for handlers that use request->headers["Name"] like the former std::map member.
+ *
+ * The map is built from the header views on first use in a request and allocates like before.
+ * Names are case sensitive as received, get_header() is the allocation free and case insensitive way.
+ */
+class HttpHeaderMap {
+public:
+    HttpHeaderMap(HttpParsedRequest* request) : _request(request), _valid(false) {}
+
+    string& operator[](const string& name) { return get()[name]; }
+    MapHeaderIterator find(const string& name) { return get().find(name); }
+    size_t count(const string& name) { return get().count(name); }
+    MapHeaderIterator begin() { return get().begin(); }
+    MapHeaderIterator end() { return get().end(); }
+    size_t size() { return get().size(); }
+    bool empty() { return get().empty(); }
+    operator MapHeaders&() { return get(); }
+
+    // headers changed, build again on next use
+    void reset()
+    {
+        if (_valid) {
+            _map.clear();
+            _valid = false;
+        }
+    }
+
+private:
+    inline MapHeaders& get();
+
+    HttpParsedRequest* _request;
+    bool _valid;
+    MapHeaders _map;
+};
+
 class HttpParsedRequest {
 public:
-    HttpParsedRequest() {
+    HttpParsedRequest() : headers(this) {
         body = NULL;
+        body_arena_size = 0;
+        _buffer = NULL;
+        _headerFilter = NULL;
         clear();
     }
 
@@ -38,20 +180,46 @@ public:
     }
 
     void clear() {
+        headers.reset();
         status_code = 0;
         concat_header_field = false;
         concat_header_value = false;
+        _ignoreHeader = false;
         expected_content_length = 0;
         is_chunked = false;
         is_message_completed = false;
+        is_headers_completed = false;
+        is_keep_alive = false;
         body_length = 0;
         body_offset = 0;
-        if (body != NULL) {
-            free(body);
-            body = NULL;
-        }
+        is_body_too_large = false;
+        body = NULL;                        // arena belongs to the connection
+        body_arena_size = 0;
         
-        headers.clear();
+        _url.offset = 0;
+        _url.length = 0;
+        _headerCount = 0;
+        _headerNamePending = false;
+        _headerFilter = NULL;
+        _paramCount = 0;
+        memset(_wellKnownHeaders, 0, sizeof(_wellKnownHeaders));
+        memset(_headerIndex, 0, sizeof(_headerIndex));
+        _retainedLength = 0;
+    }
+
+    /*
+        receive buffer that holds the request, all views are relative to this.
+        Must be set again when the connection moves the data to another buffer.
+    */
+    void set_buffer(const char* buffer) {
+        _buffer = buffer;
+    }
+
+    /*
+        number of bytes at the beginning of the receive buffer that are referenced by url and headers
+    */
+    uint32_t get_retained_length() {
+        return _retainedLength;
     }
 
     void set_status(int a_status_code, string a_status_message) {
@@ -67,53 +235,77 @@ public:
         return status_message;
     }
 
-    void set_url(string a_url) {
-        url = a_url;
+    // called by parser, url may arrive in several pieces
+    void set_url(const char *at, uint32_t length) {
+        if (_url.length == 0) {
+            _url.offset = at - _buffer;
+        }
+        _url.length += length;
+        retain(_url);
+    }
+
+    HttpStringView get_url_view() {
+        return view(_url);
     }
 
     string get_url() {
-        return url;
+        return get_url_view().str();
+    }
+
+    /*
+        url without query
+    */
+    HttpStringView get_path_view() {
+        HttpStringView url = get_url_view();
+        size_t end = 0;
+        while (end < url.length && url.data[end] != '?') {
+            end++;
+        }
+        return HttpStringView(url.data, end);
     }
 
     /*
         return path up to last /
     */
     string get_path() {
-        string path(url);
-        size_t found = url.find_last_of("/");
-        if(found) {
-            path.erase(found+1, string::npos);
+        HttpStringView url = get_url_view();
+        size_t found = url.length;
+        while (found > 0 && url.data[found - 1] != '/') {
+            found--;
         }
-        return path;
+        if (found == 0) {
+            return url.str();
+        }
+        return string(url.data, found);
     }
 
     /*
         return filename from last / to first ?
     */
     string get_filename() {
-        string filename;
-        size_t foundSlash = url.find_last_of("/");
-        if (foundSlash == string::npos)
-            foundSlash = 0;
-        size_t foundQM = url.find_first_of("?");
-        if (foundQM)
-            foundQM--;
-
-        filename = url.substr(foundSlash+1, foundQM - foundSlash);
-        return filename;
+        HttpStringView url = get_url_view();
+        size_t end = 0;
+        while (end < url.length && url.data[end] != '?') {
+            end++;
+        }
+        size_t start = end;
+        while (start > 0 && url.data[start - 1] != '/') {
+            start--;
+        }
+        return string(url.data + start, end - start);
     }
 
     /*
         return filename from first ? to end
     */
     string get_query() {
-        string query;
-        size_t foundQM = url.find_first_of("?");
-        if (foundQM == string::npos)
-            return query;
-
-        query = url.substr(foundQM);
-        return query;
+        HttpStringView url = get_url_view();
+        for (size_t i = 0; i < url.length; i++) {
+            if (url.data[i] == '?') {
+                return string(url.data + i, url.length - i);
+            }
+        }
+        return string();
     }
 
     void set_method(http_method a_method) {
@@ -132,74 +324,182 @@ public:
         return is_Upgrade;
     }
 
-    MapHeaders headers;
-
-    void set_header_field(string field) {
+    // called by parser, header names and values may arrive in several pieces
+    void set_header_field(const char *at, uint32_t length) {
         concat_header_value = false;
 
-        // headers can be chunked
+        // headers can be chunked, the pieces are adjacent in the receive buffer
         if (concat_header_field) {
-            _headerField += field;
-        }
-        else {
-            _headerField = field;
+            if (!_ignoreHeader) {
+                _headers[_headerCount - 1].name.length += length;
+                retain(_headers[_headerCount - 1].name);
+            }
+            return;
         }
 
+        finish_header_name();
         concat_header_field = true;
+
+        if (_headerCount < HTTP_MAX_HEADERS) {
+            HttpHeaderEntry& entry = _headers[_headerCount++];
+            entry.name.offset = at - _buffer;
+            entry.name.length = length;
+            entry.value.offset = 0;
+            entry.value.length = 0;
+            _ignoreHeader = false;
+            _headerNamePending = true;
+            retain(entry.name);
+        } else {
+            debug("too many request headers, ignored: %.*s\n", (int)length, at);
+            _ignoreHeader = true;
+        }
     }
 
-    void set_header_value(string value) {
+    void set_header_value(const char *at, uint32_t length) {
         concat_header_field = false;
 
-        // headers can be chunked
-        if (concat_header_value) {
-            _headerValue += value;
+        if (!_ignoreHeader) {
+            finish_header_name();                                   // may drop the header
         }
-        else {
-            _headerValue = value;
-            headers[_headerField] = _headerValue;
+        if (!_ignoreHeader) {
+            HttpHeaderEntry& entry = _headers[_headerCount - 1];
+            if (concat_header_value) {
+                entry.value.length += length;
+            }
+            else {
+                entry.value.offset = at - _buffer;
+                entry.value.length = length;
+            }
+            retain(entry.value);
         }
 
         concat_header_value = true;
     }
 
-    // called by parser on request
-    void set_headers_complete() {
-        MapHeaderIterator it = headers.find("Content-Length");
-        if(it != headers.end()) {
-            expected_content_length = atoi(it->second.c_str());
+    /*
+        headers not accepted by the filter are dropped while parsing. Must be set before the
+        first header arrives, nullptr stores all headers.
+    */
+    void set_header_filter(const HttpHeaderFilter* filter) {
+        _headerFilter = filter;
+    }
+
+    // called by the router, value must be a view into the url
+    void clear_params() {
+        _paramCount = 0;
+    }
+
+    void add_param(const char* name, HttpStringView value) {
+        if (_paramCount < HTTP_MAX_ROUTE_PARAMS) {
+            HttpRouteParam& param = _params[_paramCount++];
+            param.name = name;
+            param.value.offset = value.data - _buffer;
+            param.value.length = value.length;
         }
     }
 
-    // called by parser on request
-    void set_body(const char *at, uint32_t length) {
-        // Connection: close, could not specify Content-Length, nor chunked... So do it like this:
-        if (expected_content_length == 0 && length > 0) {
-            is_chunked = true;
+    /*
+        path parameter of the route, e.g. id for /api/sensor/:id. Empty if not found
+    */
+    HttpStringView get_param(const char* name) {
+        for (int i = 0; i < _paramCount; i++) {
+            if (strcmp(_params[i].name, name) == 0) {
+                return view(_params[i].value);
+            }
         }
+        return HttpStringView();
+    }
+
+    int get_param_count() {
+        return _paramCount;
+    }
 
-        // only malloc when this fn is called, so we don't alloc when body callback's are enabled
-        if (body == NULL && !is_chunked) {
-            body = (char*)malloc(expected_content_length);
+    const char* get_param_name(int index) {
+        return _params[index].name;
+    }
+
+    HttpStringView get_param_value(int index) {
+        return view(_params[index].value);
+    }
+
+    /*
+        value of a well known header, empty if not found
+    */
+    HttpStringView get_header(HttpHeaderId id) {
+        int index = _wellKnownHeaders[id];
+        if (index == 0) {
+            return HttpStringView();
         }
+        return view(_headers[index - 1].value);
+    }
 
-        if (is_chunked) {
-            if (body == NULL) {
-                body = (char*)malloc(length);
-            }
-            else {
-                char* original_body = body;
-                body = (char*)realloc(body, body_offset + length);
-                if (body == NULL) {
-                    free(original_body);
-                    return;
-                }
-            }
+    /*
+        value of header with name (case insensitive), empty if not found
+    */
+    HttpStringView get_header(const char* name) {
+        int index = find_header(HttpStringView(name));
+        if (index < 0) {
+            return HttpStringView();
         }
+        return view(_headers[index].value);
+    }
 
-        memcpy(body + body_offset, at, length);
+    bool has_header(const char* name) {
+        return find_header(HttpStringView(name)) >= 0;
+    }
+
+    // all headers as map, built on first use. Prefer get_header(), it does not allocate
+    HttpHeaderMap headers;
+
+    int get_header_count() {
+        return _headerCount;
+    }
+
+    HttpStringView get_header_name(int index) {
+        return view(_headers[index].name);
+    }
+
+    HttpStringView get_header_value(int index) {
+        return view(_headers[index].value);
+    }
+
+    // called by parser on request
+    void set_headers_complete() {
+        finish_header_name();
+        is_headers_completed = true;
+        HttpStringView contentLength = get_header(HTTP_HEADER_CONTENT_LENGTH);
+        if (!contentLength.empty()) {
+            expected_content_length = contentLength.toUInt();
+        }
+    }
 
+    bool is_headers_complete() {
+        return is_headers_completed;
+    }
+
+    /*
+        buffer for the request body, owned by the connection and reused for every request.
+        Without an arena the body is not stored.
+    */
+    void set_body_arena(char* arena, uint32_t size) {
+        body = arena;
+        body_arena_size = size;
+    }
+
+    // called by parser on request, false if the body does not fit into the arena
+    bool set_body(const char *at, uint32_t length) {
+        if (body == NULL || (body_offset + length > body_arena_size)) {
+            is_body_too_large = true;
+            return false;
+        }
+
+        memcpy(body + body_offset, at, length);
         body_offset += length;
+        return true;
+    }
+
+    bool body_too_large() {
+        return is_body_too_large;
     }
 
     void* get_body() {
@@ -207,6 +507,9 @@ public:
     }
 
     string get_body_as_string() {
+        if (body == NULL) {
+            return string();
+        }
         string s(body, body_offset);
         return s;
     }
@@ -231,51 +534,138 @@ public:
         is_message_completed = true;
         http_major = parser->http_major;
         http_minor = parser->http_minor;
+        is_keep_alive = http_should_keep_alive(parser);
+    }
+
+    // client accepts a persistent connection (HTTP/1.1 default or HTTP/1.0 with keep-alive)
+    bool should_keep_alive() {
+        return is_keep_alive;
+    }
+
+    uint16_t get_http_major() {
+        return http_major;
+    }
+
+    uint16_t get_http_minor() {
+        return http_minor;
     }
 
 private:
-    // from http://stackoverflow.com/questions/5820810/case-insensitive-string-comp-in-c
-    int strcicmp(char const *a, char const *b) {
-        for (;; a++, b++) {
-            int d = tolower(*a) - tolower(*b);
-            if (d != 0 || !*a) {
-                return d;
+    HttpStringView view(const HttpBufferSpan& span) {
+        return HttpStringView(_buffer + span.offset, span.length);
+    }
+
+    /*
+        the name of the last header is complete, intern well known names and add it to the hash index.
+        Headers the filter does not accept are dropped again. For duplicate headers the first one is found.
+    */
+    void finish_header_name() {
+        if (!_headerNamePending) {
+            return;
+        }
+        _headerNamePending = false;
+
+        int index = _headerCount - 1;
+        HttpHeaderEntry& entry = _headers[index];
+        HttpStringView name = view(entry.name);
+        entry.hash = name.hashIgnoreCase();
+        entry.id = HTTP_HEADER_UNKNOWN;
+
+        for (int id = 0; id < HTTP_HEADER_COUNT; id++) {
+            if ((httpWellKnownHeaders[id].hash == entry.hash) && name.equalsIgnoreCase(httpWellKnownHeaders[id].name)) {
+                entry.id = id;
+                break;
+            }
+        }
+
+        if (_headerFilter && !_headerFilter->accepts(entry.id, entry.hash)) {
+            _headerCount--;
+            _ignoreHeader = true;
+            return;
+        }
+
+        if ((entry.id != HTTP_HEADER_UNKNOWN) && (_wellKnownHeaders[entry.id] == 0)) {
+            _wellKnownHeaders[entry.id] = index + 1;
+        }
+
+        // open addressing, linear probing
+        const int mask = httpHeaderIndexSize() - 1;
+        for (int slot = entry.hash & mask; ; slot = (slot + 1) & mask) {
+            if (_headerIndex[slot] == 0) {
+                _headerIndex[slot] = index + 1;
+                break;
+            }
+            HttpHeaderEntry& other = _headers[_headerIndex[slot] - 1];
+            if ((other.hash == entry.hash) && view(other.name).equalsIgnoreCase(name)) {
+                break;                                              // duplicate, keep first
             }
         }
     }
 
-    char tolower(char c) {
-        if(('A' <= c) && (c <= 'Z')) {
-            return 'a' + (c - 'A');
+    int find_header(HttpStringView name) {
+        uint32_t hash = name.hashIgnoreCase();
+        const int mask = httpHeaderIndexSize() - 1;
+        for (int slot = hash & mask; _headerIndex[slot] != 0; slot = (slot + 1) & mask) {
+            HttpHeaderEntry& entry = _headers[_headerIndex[slot] - 1];
+            if ((entry.hash == hash) && view(entry.name).equalsIgnoreCase(name)) {
+                return _headerIndex[slot] - 1;
+            }
         }
+        return -1;
+    }
 
-        return c;
+    void retain(const HttpBufferSpan& span) {
+        if (span.offset + span.length > _retainedLength) {
+            _retainedLength = span.offset + span.length;
+        }
     }
 
     int status_code;
     string status_message;
-    string url;
     http_method method;
 
-    string _headerField;
-    string _headerValue;
-    //vector<string*> header_fields;
-    //vector<string*> header_values;
+    const char* _buffer;
+    HttpBufferSpan _url;
+    HttpHeaderEntry _headers[HTTP_MAX_HEADERS];
+    int _headerCount;
+    bool _headerNamePending;
+    const HttpHeaderFilter* _headerFilter;
+    HttpRouteParam _params[HTTP_MAX_ROUTE_PARAMS];
+    int _paramCount;
+    uint8_t _wellKnownHeaders[HTTP_HEADER_COUNT];       // index + 1 into _headers, 0: not present
+    uint8_t _headerIndex[httpHeaderIndexSize()];        // hash index, index + 1 into _headers, 0: empty
+    uint32_t _retainedLength;
 
     bool concat_header_field;
     bool concat_header_value;
+    bool _ignoreHeader;
 
     uint32_t expected_content_length;
 
     bool is_chunked;
     bool is_message_completed;
+    bool is_headers_completed;
     bool is_Upgrade;                // upgrade requst found
+    bool is_keep_alive;
     uint16_t http_minor;
     uint16_t http_major;
 
     char * body;
+    uint32_t body_arena_size;
+    bool is_body_too_large;
     uint32_t body_length;
     uint32_t body_offset;
 };
 
+MapHeaders& HttpHeaderMap::get()
+{
+    if (!_valid) {
+        for (int i = 0; i < _request->get_header_count(); i++) {
+            _map[_request->get_header_name(i).str()] = _request->get_header_value(i).str();
+        }
+        _valid = true;
+    }
+    return _map;
+}
+
 #endif
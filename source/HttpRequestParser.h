@@ -18,6 +18,7 @@
 #ifndef _HTTP_RESPONSE_PARSER_H_
 #define _HTTP_RESPONSE_PARSER_H_
 
+#include <limits.h>
 #include "../http_parser/http_parser.h"
 #include "HttpParsedRequest.h"
 
@@ -46,6 +47,7 @@ public:
         _parser = new http_parser();
         http_parser_init(_parser, _parser_type);
         _parser->data = (void*)this;
+        _urlComplete = false;
     }
 
     ~HttpRequestParser() {
@@ -59,12 +61,51 @@ public:
 
     void clear() {
         http_parser_init(_parser, _parser_type);
+        _urlComplete = false;
+    }
+
+    void set_body_callback(Callback<void(const char *at, uint32_t length)> bodyCallback) {
+        _bodyCallback = bodyCallback;
+    }
+
+    /*
+        called when all request headers are parsed, return false to stop parsing with an error
+    */
+    void set_headers_complete_callback(Callback<bool()> headersCompleteCallback) {
+        _headersCompleteCallback = headersCompleteCallback;
+    }
+
+    /*
+        called once per request when the url is complete, before the first header is passed to the parsed request
+    */
+    void set_url_complete_callback(Callback<void()> urlCompleteCallback) {
+        _urlCompleteCallback = urlCompleteCallback;
     }
 
     uint32_t execute(const char* buffer, uint32_t buffer_size) {
         return http_parser_execute(_parser, _settings, buffer, buffer_size);
     }
 
+    bool has_error() {
+        return (HTTP_PARSER_ERRNO(_parser) != HPE_OK) && (HTTP_PARSER_ERRNO(_parser) != HPE_PAUSED);
+    }
+
+    // request has a body, valid when headers are complete
+    bool has_body() {
+        return (_parser->flags & F_CHUNKED) ||
+            ((_parser->content_length > 0) && (_parser->content_length != ULLONG_MAX));
+    }
+
+    // declared Content-Length, ULLONG_MAX if there is none
+    uint64_t get_content_length() {
+        return _parser->content_length;
+    }
+
+    // continue after the pause at the end of each message
+    void resume() {
+        http_parser_pause(_parser, 0);
+    }
+
     void finish() {
         http_parser_execute(_parser, _settings, NULL, 0);
     }
@@ -72,12 +113,22 @@ public:
 private:
     // Member functions
     int on_message_begin(http_parser* parser) {
+        _urlComplete = false;
         return 0;
     }
 
+    void url_complete(http_parser* parser) {
+        if (!_urlComplete) {
+            _urlComplete = true;
+            _parsedRequest->set_method((http_method)parser->method);      // routes are selected by method too
+            if (_urlCompleteCallback) {
+                _urlCompleteCallback();
+            }
+        }
+    }
+
     int on_url(http_parser* parser, const char *at, uint32_t length) {
-        string s(at, length);
-        _parsedRequest->set_url(s);
+        _parsedRequest->set_url(at, length);
         return 0;
     }
 
@@ -88,21 +139,24 @@ private:
     }
 
     int on_header_field(http_parser* parser, const char *at, uint32_t length) {
-        string s(at, length);
-        _parsedRequest->set_header_field(s);
+        url_complete(parser);
+        _parsedRequest->set_header_field(at, length);
         return 0;
     }
 
     int on_header_value(http_parser* parser, const char *at, uint32_t length) {
-        string s(at, length);
-        _parsedRequest->set_header_value(s);
+        _parsedRequest->set_header_value(at, length);
         return 0;
     }
 
     int on_headers_complete(http_parser* parser) {
+        url_complete(parser);
         _parsedRequest->set_headers_complete();
         _parsedRequest->set_method((http_method)parser->method);
         _parsedRequest->set_Upgrade(parser->upgrade);
+        if (_headersCompleteCallback && !_headersCompleteCallback()) {
+            return -1;
+        }
         return 0;
     }
 
@@ -114,12 +168,15 @@ private:
             return 0;
         }
 
-        _parsedRequest->set_body(at, length);
+        if (!_parsedRequest->set_body(at, length)) {
+            return -1;                          // body too large, stop parsing
+        }
         return 0;
     }
 
     int on_message_complete(http_parser* parser) {
         _parsedRequest->set_message_complete(parser);
+        http_parser_pause(parser, 1);           // return from execute(), next request may follow in the same buffer
 
         return 0;
     }
@@ -177,6 +234,9 @@ private:
 
     HttpParsedRequest* _parsedRequest;
     Callback<void(const char *at, uint32_t length)> _bodyCallback;
+    Callback<void()> _urlCompleteCallback;
+    Callback<bool()> _headersCompleteCallback;
+    bool _urlComplete;
     http_parser* _parser;
     http_parser_type _parser_type;
     http_parser_settings* _settings;
@@ -20,10 +20,13 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "../http_parser/http_parser.h"
 #include "HttpParsedRequest.h"
 #include "ClientConnection.h"
 #include "HttpServer.h"
+#include "HttpDate.h"
+#include "HttpHeaderWriter.h"
 
 static const char* get_http_status_string(uint16_t statusCode) {
     switch (statusCode) {
@@ -90,6 +93,10 @@ static const char* get_http_status_string(uint16_t statusCode) {
     }
 }
 
+// separates the parts of multipart/byteranges responses
+#define HTTP_BYTERANGES_BOUNDARY    "3d6b6a416f9b5mbedhttp"
+#define HTTP_BYTERANGES_TRAILER     "\r\n--" HTTP_BYTERANGES_BOUNDARY "--\r\n"
+
 static const struct mapping_t {
     const char* key;
     const char* value;
@@ -100,7 +107,7 @@ static const struct mapping_t {
     {"ico", "image/x-icon"},
     {"png", "image/png"   },
     {"zip", "image/zip"   },
-    {"gz",  "image/gz"    },
+    {"gz",  "application/gzip"},
     {"tar", "image/tar"   },
     {"txt", "plain/text"  },
     {"pdf", "application/pdf" },
@@ -109,144 +116,937 @@ static const struct mapping_t {
     {"css", "text/css"    },
     {"js",  "text/javascript"}};
 
+// content for sendChunked(): fill buffer with up to size bytes, return the number of bytes, 0 at the end or < 0 on error
+typedef Callback<ssize_t(char* buffer, size_t size)> CallbackContentSource;
+
+// "bytes " and three 20 digit numbers
+#define HTTP_CONTENT_RANGE_LENGTH   72
+
+// room for the status line in front of the headers in the header buffer, the longest reason phrase is 31 characters
+#define HTTP_STATUS_LINE_SIZE       64
+
+// path of a precompressed file (name.gz), longer names are sent without looking for one
+#ifndef HTTP_FILE_PATH_SIZE
+#define HTTP_FILE_PATH_SIZE         128
+#endif
+
+// quoted ETag, size and hash or time in hex
+#define HTTP_ETAG_SIZE              32
+
+// header of a part in multipart/byteranges: boundary, Content-Type and Content-Range
+#define HTTP_PART_HEADER_SIZE       160
+
 class HttpResponseBuilder {
 public:
-    HttpResponseBuilder(ClientConnection* clientConnection) : 
+    /*
+        the response header is serialized into headerBuffer, or into a buffer from the send buffer pool
+        of the server while the builder exists. Without a free buffer, sending the header fails with 500.
+        The headers set by the handler are kept in the same buffer, behind the room for the status line.
+    */
+    HttpResponseBuilder(ClientConnection* clientConnection, char* headerBuffer = nullptr, size_t headerBufferSize = 0) : 
         _clientConnection(clientConnection)
     {
+        _pooledHeaderBuffer = nullptr;
+        if (headerBuffer == nullptr) {
+            size_t size;
+            _pooledHeaderBuffer = clientConnection->getServer()->getSendBufferPool().alloc(HTTP_RESPONSE_HEADER_SIZE, &size);
+            headerBuffer = (char*)_pooledHeaderBuffer;
+            headerBufferSize = _pooledHeaderBuffer ? HTTP_RESPONSE_HEADER_SIZE : 0;
+        }
+        _headerBuffer = headerBuffer;
+        _headerBufferSize = headerBufferSize;
+        if (_headerBufferSize > HTTP_STATUS_LINE_SIZE)
+            headers.init(_headerBuffer + HTTP_STATUS_LINE_SIZE, _headerBufferSize - HTTP_STATUS_LINE_SIZE);
+        _header = nullptr;
+        _headerLength = 0;
+        _headerBlock = nullptr;
+        _headerBlockLength = 0;
+        _chunkBuffer = nullptr;
+        _chunkLength = 0;
+        _streaming = false;
+        _chunked = false;
+        _streamError = NSAPI_ERROR_OK;
+    }
+
+    ~HttpResponseBuilder()
+    {
+        // complete a streamed response the handler did not end
+        if (_streaming)
+            endChunked();
+        HttpBufferPool& pool = _clientConnection->getServer()->getSendBufferPool();
+        pool.free((uint8_t*)_chunkBuffer);
+        pool.free(_pooledHeaderBuffer);
     }
 
-    map<string, string> headers;
+    // additional headers, names and values are copied into the header buffer
+    HttpResponseHeaders headers;
 
+    /*
+        @return bytes sent or error, NSAPI_ERROR_NO_MEMORY if the header did not fit into the header buffer
+    */
     nsapi_size_or_error_t sendHeader(uint16_t statusCode) 
     {
-        _buffer.reserve(512);
-
-        _buffer = "HTTP/1.1 ";
-        _buffer += to_string(statusCode);
-        _buffer += " ";
-        _buffer += get_http_status_string(statusCode);
-        _buffer += "\r\n";
-
-        // get standardHeaders from HTTPServer
-        map<string, string> standardHeaders = _clientConnection->getServer()->getStandardHeaders();
-        for(auto it : standardHeaders) {
-            // line is KEY: VALUE\r\n
-            _buffer += it.first;
-            _buffer += ":";
-            _buffer += it.second;
-            _buffer += "\r\n";
+        if (!buildHeader(statusCode))
+            return sendHeaderOverflow();
+
+        return _clientConnection->send(_header, _headerLength);
+    }
+
+    /*
+        response header in _headerBuffer, no heap allocation. The status line goes right in front of
+        the header lines, the other headers behind them. The result is _header, _headerLength.
+        @return false if the header does not fit into the buffer
+    */
+    bool buildHeader(uint16_t statusCode)
+    {
+        _header = nullptr;
+        _headerLength = 0;
+        if (_headerBufferSize <= HTTP_STATUS_LINE_SIZE || headers.overflowed())
+            return false;
+
+        // the handler may close a persistent connection, but not keep one open the server closes
+        HttpStringView connection = headers.get("Connection");
+        if (connection.data != nullptr && connection.equalsIgnoreCase("close"))
+            _clientConnection->setKeepAlive(false);
+        else if (connection.data != nullptr && !_clientConnection->isKeepAlive())
+            headers.remove("Connection");
+        bool handlerConnection = headers.has("Connection");
+
+        char statusLine[HTTP_STATUS_LINE_SIZE];
+        HttpHeaderWriter status(statusLine, sizeof(statusLine));
+        status.statusLine(statusCode, get_http_status_string(statusCode));
+        if (!status.ok())
+            return false;
+        char* header = _headerBuffer + HTTP_STATUS_LINE_SIZE - status.length();
+        memcpy(header, statusLine, status.length());
+
+        size_t linesEnd = HTTP_STATUS_LINE_SIZE + headers.length();
+        HttpHeaderWriter writer(_headerBuffer + linesEnd, _headerBufferSize - linesEnd);
+
+        // standard headers of HTTPServer, serialized when they were added
+        _clientConnection->appendStandardHeaders(writer);
+
+        char dateLine[HTTP_DATE_LINE_LENGTH];
+        size_t dateLength = _clientConnection->getServer()->getDateCache().get(dateLine);
+        writer.append(dateLine, dateLength);
+
+        // persistent connection, unless the handler set Connection itself
+        if (!handlerConnection) {
+            if (_clientConnection->isKeepAlive()) {
+                writer.header("Connection", "keep-alive");
+                writer.append("Keep-Alive: timeout=");
+                writer.appendNumber(HTTP_KEEPALIVE_TIMEOUT / 1000);
+                writer.append(", max=");
+                writer.appendNumber(_clientConnection->getRemainingRequests());
+                writer.append("\r\n", 2);
+            } else {
+                writer.header("Connection", "close");
+            }
         }
 
-        // send additional Headers
-        for(auto it : headers) {
-            // line is KEY: VALUE\r\n
-            _buffer += it.first;
-            _buffer += ":";
-            _buffer += it.second;
-            _buffer += "\r\n";
+        writer.append(_headerBlock, _headerBlockLength);           // prepared lines, e.g. of a cached file
+        writer.end();
+        if (!writer.ok())
+            return false;
+
+        _header = header;
+        _headerLength = status.length() + headers.length() + writer.length();
+        return true;
+    }
+
+    /*
+        send a file. If filename.gz exists and the client accepts gzip, the compressed file is
+        sent instead, with the content type of the original file.
+        Files are sent with validators (ETag, Last-Modified if the file system keeps the time), a
+        conditional GET that matches gets 304 without body. HEAD requests get the header only.
+    */
+    nsapi_size_or_error_t sendHeaderAndFile(FileSystem *fs, const string& filename) {
+        FileVariant variant;
+        selectVariant(fs, filename, &variant);
+
+        struct stat st;
+        if (fs->stat(variant.path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            debug("%s: file not found: %s\n", _clientConnection->getThreadname(), filename.c_str());
+            headers.setNumber("Content-Length", 0);
+            sendHeader(404);
+            return 0;
         }
+        size_t fileSize = st.st_size;
 
-        _buffer += "\r\n";
+        // the file from the cache or from the file system
+        HttpFileCache& cache = _clientConnection->getServer()->getFileCache();
+        const HttpFileCacheEntry* entry = nullptr;
+        if (cache.isEnabled()) {
+            entry = cache.acquire(fs, variant.path, st);
+            if (entry == nullptr)
+                entry = loadFile(cache, fs, filename, variant, st);
+        }
+
+        // no heap allocation for a file that is not cached
+        char etagBuffer[HTTP_ETAG_SIZE];
+        const char* etag = etagBuffer;
+        if (entry)
+            etag = entry->etag.c_str();
+        else
+            makeETag(fs, variant.path, st, nullptr, etagBuffer);
+
+        // validators
+        if (etag[0] != '\0')
+            headers.set("ETag", etag);
+        char lastModified[HTTP_DATE_LENGTH + 1];
+        if (st.st_mtime > 0 && httpFormatDate(st.st_mtime, lastModified) > 0)
+            headers.set("Last-Modified", lastModified);
+
+        // per response, the cached header lines are the same whether a precompressed file exists or not
+        if (variant.hasGzip)
+            headers.set("Vary", "Accept-Encoding");
 
-        // debug("header: %s",_buffer.c_str());
+        debug("%s: send file: %s  size: %d Bytes\n", _clientConnection->getThreadname(), variant.path, fileSize);
 
-        // send header
-        nsapi_size_or_error_t sent = _clientConnection->send(_buffer.c_str(),  _buffer.size());
+        nsapi_size_or_error_t sent;
+        if (isNotModified(etag, st)) {
+            sent = sendHeader(304);
+        } else {
+            headers.set("Accept-Ranges", "bytes");
+            headers.remove("Content-Type");
+            headers.remove("Content-Encoding");
+
+            ByteRange ranges[HTTP_MAX_RANGES];
+            int nRanges = getRanges(fileSize, etag, st, ranges);
+            char contentRange[HTTP_CONTENT_RANGE_LENGTH];
+            if (nRanges == 0) {
+                // no range within the file
+                headers.set("Content-Range", formatContentRange(contentRange, nullptr, fileSize));
+                headers.setNumber("Content-Length", 0);
+                sent = sendHeader(416);
+            } else if (nRanges == 1 || nRanges < 0) {
+                // whole file or single range, Content-Type and encoding are prepared lines of a cached file
+                ByteRange range = { 0, fileSize };
+                if (nRanges == 1) {
+                    range = ranges[0];
+                    headers.set("Content-Range", formatContentRange(contentRange, &range, fileSize));
+                }
+                headers.setNumber("Content-Length", range.length);
+                if (entry) {
+                    _headerBlock = entry->header;
+                    _headerBlockLength = entry->headerLength;
+                } else {
+                    setFileHeaders(filename, variant);
+                }
+                bool built = buildHeader((nRanges == 1) ? 206 : 200);
+                _headerBlock = nullptr;
+                _headerBlockLength = 0;
+
+                // without modification time, the hash for the ETag of the next response is taken while sending
+                bool hashContent = (entry == nullptr && etag[0] == '\0' && st.st_mtime == 0 && nRanges < 0);
+                if (built)
+                    sent = sendFileData(fs, variant.path, entry, &range, 1, nullptr, hashContent);
+                else
+                    sent = sendHeaderOverflow();
+            } else {
+                // multipart/byteranges, each part has its own header, formatted again while sending
+                Multipart multipart = { getContentType(getExtension(filename)), fileSize };
+                char partHeader[HTTP_PART_HEADER_SIZE];
+                size_t contentLength = sizeof(HTTP_BYTERANGES_TRAILER) - 1;
+                for (int i = 0; i < nRanges; i++) {
+                    contentLength += formatPartHeader(partHeader, multipart, ranges[i]) + ranges[i].length;
+                }
+
+                headers.set("Content-Type", "multipart/byteranges; boundary=" HTTP_BYTERANGES_BOUNDARY);
+                headers.setNumber("Content-Length", contentLength);
+                if (variant.gzip)
+                    headers.set("Content-Encoding", "gzip");
+
+                if (buildHeader(206))
+                    sent = sendFileData(fs, variant.path, entry, ranges, nRanges, &multipart, false);
+                else
+                    sent = sendHeaderOverflow();
+            }
+        }
+
+        cache.release(entry);
+        return (sent < 0) ? sent : (nsapi_size_or_error_t)fileSize;
+    }
+
+    nsapi_error_t sendContent(uint16_t statusCode, const string& content, const char* contentType = "text/html; charset=utf-8") 
+    {
+        return sendContent(statusCode, content.data(), content.length(), contentType);
+    }
+
+    nsapi_error_t sendContent(uint16_t statusCode, const char* content, size_t length, const char* contentType = "text/html; charset=utf-8") 
+    {
+        headers.set("Content-Type", contentType);
+        headers.setNumber("Content-Length", length);
+
+        // header and content together, a short response fits in one TCP segment
+        if (!buildHeader(statusCode))
+            return sendHeaderOverflow();
+        HttpSendSegment segments[] = {
+            { _header, _headerLength },
+            { content, isHeadRequest() ? 0 : length }
+        };
+        nsapi_size_or_error_t sent = _clientConnection->sendv(segments, 2);
+        if (sent >= 0) {
+            sent = length;
+        }
 
         return sent;
     }
 
-    nsapi_size_or_error_t sendHeaderAndFile(FileSystem *fs, string filename) {
-        // open file and get filesize
-        size_t fileSize = 0;
+    /*
+        streamed response of unknown length, push mode: beginChunked(), write() as often as needed, endChunked().
+        The content is collected in a buffer of chunk-size bytes and sent as Transfer-Encoding: chunked.
+        HTTP/1.0 clients don't know chunks, they get the plain content and the connection is closed at the end.
+    */
+    nsapi_error_t beginChunked(uint16_t statusCode, const char* contentType = "text/html; charset=utf-8")
+    {
+        MBED_ASSERT(!_streaming);
+
+        _chunked = isChunkedSupported();
+        headers.set("Content-Type", contentType);
+        headers.remove("Content-Length");
+        if (_chunked)
+            headers.set("Transfer-Encoding", "chunked");
+        else
+            headers.set("Connection", "close");            // the end of the content is the end of the connection
+
+        // from the send buffer pool until the response ends
+        size_t size;
+        _chunkBuffer = (char*)_clientConnection->getServer()->getSendBufferPool().alloc(HTTP_CHUNK_BUFFER_SIZE, &size);
+        if (_chunkBuffer == nullptr)
+            return NSAPI_ERROR_NO_MEMORY;
+        _chunkLength = 0;
+        _streaming = true;
+
+        nsapi_size_or_error_t sent = sendHeader(statusCode);
+        _streamError = (sent < 0) ? sent : NSAPI_ERROR_OK;
+        return _streamError;
+    }
+
+    nsapi_error_t write(const char* data, size_t length)
+    {
+        MBED_ASSERT(_streaming);
+
+        while (length > 0 && _streamError == NSAPI_ERROR_OK) {
+            size_t n = min(length, (size_t)HTTP_CHUNK_SIZE - _chunkLength);
+            memcpy(_chunkBuffer + HTTP_CHUNK_HEADER_SIZE + _chunkLength, data, n);
+            _chunkLength += n;
+            data += n;
+            length -= n;
+            if (_chunkLength == HTTP_CHUNK_SIZE)
+                sendChunk();
+        }
+        return _streamError;
+    }
+
+    nsapi_error_t write(const char* s)
+    {
+        return write(s, strlen(s));
+    }
+
+    // send the rest of the content and the last chunk
+    nsapi_error_t endChunked()
+    {
+        MBED_ASSERT(_streaming);
+
+        sendChunk();
+        if (_chunked && _streamError == NSAPI_ERROR_OK && !isHeadRequest()) {
+            nsapi_size_or_error_t sent = _clientConnection->send("0\r\n\r\n", 5);
+            if (sent < 0)
+                _streamError = sent;
+        }
+        _streaming = false;
+        _clientConnection->getServer()->getSendBufferPool().free((uint8_t*)_chunkBuffer);
+        _chunkBuffer = nullptr;
+        return _streamError;
+    }
+
+    /*
+        streamed response, pull mode: source is called for content until it returns 0
+        @return bytes of content or error
+    */
+    nsapi_size_or_error_t sendChunked(uint16_t statusCode, CallbackContentSource source, const char* contentType = "text/html; charset=utf-8")
+    {
+        nsapi_error_t err = beginChunked(statusCode, contentType);
+        size_t total = 0;
+        while (err == NSAPI_ERROR_OK && !isHeadRequest()) {
+            // the source writes directly into the chunk buffer
+            ssize_t n = source(_chunkBuffer + HTTP_CHUNK_HEADER_SIZE + _chunkLength, HTTP_CHUNK_SIZE - _chunkLength);
+            if (n <= 0) {
+                if (n < 0)
+                    err = _streamError = NSAPI_ERROR_DEVICE_ERROR;
+                break;
+            }
+            _chunkLength += n;
+            total += n;
+            if (_chunkLength == HTTP_CHUNK_SIZE)
+                sendChunk();
+            err = _streamError;
+        }
+        if (_streaming) {
+            if (err == NSAPI_ERROR_DEVICE_ERROR) {
+                // the response is incomplete, the client must not take it for the full content
+                _clientConnection->setKeepAlive(false);
+                _streaming = false;
+            } else {
+                err = endChunked();
+            }
+        }
+        return (err < 0) ? err : (nsapi_size_or_error_t)total;
+    }
+
+private:
+    // part of a file, for range requests
+    struct ByteRange {
+        size_t offset;
+        size_t length;
+    };
+
+    // file that is sent for a requested file
+    struct FileVariant {
+        const char* path;               // the requested file or gzPath
+        bool gzip;                      // path is the precompressed file
+        bool hasGzip;                   // a precompressed file exists, the response depends on Accept-Encoding
+        char gzPath[HTTP_FILE_PATH_SIZE];
+    };
+
+    // content type and size of the file for the part headers of multipart/byteranges
+    struct Multipart {
+        const char* contentType;
+        size_t fileSize;
+    };
+
+    void selectVariant(FileSystem *fs, const string& filename, FileVariant* variant)
+    {
+        variant->path = filename.c_str();
+        variant->gzip = false;
+        variant->hasGzip = false;
+
+        size_t length = filename.length();
+        if (length >= 3 && filename.compare(length - 3, 3, ".gz") == 0)
+            return;
+        if (length + sizeof(".gz") > sizeof(variant->gzPath))
+            return;
+
+        struct stat st;
+        memcpy(variant->gzPath, filename.c_str(), length);
+        memcpy(variant->gzPath + length, ".gz", sizeof(".gz"));
+        if (fs->stat(variant->gzPath, &st) != 0 || !S_ISREG(st.st_mode))
+            return;
+
+        variant->hasGzip = true;
+        if (acceptsEncoding(_clientConnection->getRequest()->get_header(HTTP_HEADER_ACCEPT_ENCODING), "gzip")) {
+            variant->path = variant->gzPath;
+            variant->gzip = true;
+        }
+    }
+
+    /*
+        Accept-Encoding: gzip, deflate;q=0.5  A coding with q=0 is not acceptable, * matches all codings
+    */
+    static bool acceptsEncoding(HttpStringView acceptEncoding, const char* coding)
+    {
+        size_t pos = 0;
+        while (pos < acceptEncoding.length) {
+            size_t end = pos;
+            while (end < acceptEncoding.length && acceptEncoding.data[end] != ',')
+                end++;
+
+            // token and optional parameters
+            size_t tokenEnd = pos;
+            while (tokenEnd < end && acceptEncoding.data[tokenEnd] != ';')
+                tokenEnd++;
+            HttpStringView token = trim(HttpStringView(acceptEncoding.data + pos, tokenEnd - pos));
+
+            if (token.equalsIgnoreCase(coding) || token.equals("*")) {
+                HttpStringView params(acceptEncoding.data + tokenEnd, end - tokenEnd);
+                bool rejected = false;
+                for (size_t i = 0; i + 1 < params.length; i++) {
+                    if (HttpStringView::toLower(params.data[i]) == 'q' && params.data[i + 1] == '=') {
+                        // q=0, q=0.0, q=0.000
+                        HttpStringView q = trim(HttpStringView(params.data + i + 2, params.length - i - 2));
+                        rejected = (q.length > 0 && q.data[0] == '0');
+                        for (size_t j = 1; rejected && j < q.length; j++)
+                            rejected = (q.data[j] == '.' || q.data[j] == '0');
+                        break;
+                    }
+                }
+                return !rejected;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    static HttpStringView trim(HttpStringView s)
+    {
+        while (s.length > 0 && (s.data[0] == ' ' || s.data[0] == '\t')) {
+            s.data++;
+            s.length--;
+        }
+        while (s.length > 0 && (s.data[s.length - 1] == ' ' || s.data[s.length - 1] == '\t'))
+            s.length--;
+        return s;
+    }
+
+    /*
+        the response header did not fit, send a minimal error response instead and close the connection
+    */
+    nsapi_size_or_error_t sendHeaderOverflow()
+    {
+        debug("%s: response header exceeds response-header-size or max-response-headers\n", _clientConnection->getThreadname());
+        static const char response[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        _clientConnection->setKeepAlive(false);
+        _clientConnection->send(response, sizeof(response) - 1);
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    // Content-Range value "bytes first-last/size", or "bytes */size" without range
+    char* formatContentRange(char* buffer, const ByteRange* range, size_t fileSize)
+    {
+        HttpHeaderWriter writer(buffer, HTTP_CONTENT_RANGE_LENGTH - 1);
+        writer.append("bytes ");
+        if (range) {
+            writer.appendNumber(range->offset);
+            writer.append("-", 1);
+            writer.appendNumber(range->offset + range->length - 1);
+        } else {
+            writer.append("*", 1);
+        }
+        writer.append("/", 1);
+        writer.appendNumber(fileSize);
+        buffer[writer.length()] = '\0';
+        return buffer;
+    }
+
+    /*
+        header of a part in multipart/byteranges into buffer (HTTP_PART_HEADER_SIZE bytes)
+        @return length
+    */
+    size_t formatPartHeader(char* buffer, const Multipart& multipart, const ByteRange& range)
+    {
+        char contentRange[HTTP_CONTENT_RANGE_LENGTH];
+        HttpHeaderWriter writer(buffer, HTTP_PART_HEADER_SIZE);
+        writer.append("\r\n--" HTTP_BYTERANGES_BOUNDARY "\r\n");
+        if (multipart.contentType)
+            writer.header("Content-Type", multipart.contentType);
+        writer.header("Content-Range", formatContentRange(contentRange, &range, multipart.fileSize));
+        writer.end();
+        return writer.length();
+    }
+
+    bool isChunkedSupported()
+    {
+        HttpParsedRequest* request = _clientConnection->getRequest();
+        return (request->get_http_major() > 1) || (request->get_http_major() == 1 && request->get_http_minor() >= 1);
+    }
+
+    // send the collected content as one chunk, the size line goes into the room in front of it
+    void sendChunk()
+    {
+        size_t length = _chunkLength;
+        _chunkLength = 0;
+        if (length == 0 || _streamError != NSAPI_ERROR_OK || isHeadRequest())
+            return;
+
+        char* data = _chunkBuffer + HTTP_CHUNK_HEADER_SIZE;
+        char* start = data;
+        if (_chunked) {
+            static const char hexDigits[] = "0123456789ABCDEF";
+            *--start = '\n';
+            *--start = '\r';
+            size_t n = length;
+            do {
+                *--start = hexDigits[n & 0x0f];
+                n >>= 4;
+            } while (n > 0);
+            data[length++] = '\r';
+            data[length++] = '\n';
+        }
+
+        nsapi_size_or_error_t sent = _clientConnection->send(start, (data - start) + length);
+        if (sent < 0)
+            _streamError = sent;
+    }
+
+    bool isHeadRequest()
+    {
+        return _clientConnection->getRequest()->get_method() == HTTP_HEAD;
+    }
+
+    /*
+        conditional GET: If-None-Match has precedence over If-Modified-Since (RFC 7232 6)
+    */
+    bool isNotModified(const char* etag, const struct stat& st)
+    {
+        HttpParsedRequest* request = _clientConnection->getRequest();
+        if (request->get_method() != HTTP_GET && request->get_method() != HTTP_HEAD)
+            return false;
+
+        HttpStringView ifNoneMatch = request->get_header(HTTP_HEADER_IF_NONE_MATCH);
+        if (!ifNoneMatch.empty())
+            return etag[0] != '\0' && matchesETag(ifNoneMatch, etag);
+
+        HttpStringView ifModifiedSince = request->get_header(HTTP_HEADER_IF_MODIFIED_SINCE);
+        time_t since;
+        if (!ifModifiedSince.empty() && st.st_mtime > 0 && httpParseDate(ifModifiedSince, &since))
+            return st.st_mtime <= since;
+
+        return false;
+    }
+
+    /*
+        list of entity tags or *, weak comparison (W/ is ignored)
+    */
+    static bool matchesETag(HttpStringView list, const char* etag)
+    {
+        size_t pos = 0;
+        while (pos < list.length) {
+            size_t end = pos;
+            while (end < list.length && list.data[end] != ',')
+                end++;
+
+            HttpStringView tag = trim(HttpStringView(list.data + pos, end - pos));
+            if (tag.length >= 2 && tag.data[0] == 'W' && tag.data[1] == '/') {
+                tag.data += 2;
+                tag.length -= 2;
+            }
+            if (tag.equals("*") || tag.equals(etag))
+                return true;
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    /*
+        strong ETag from size and modification time. File systems without modification time get a
+        hash of the content instead, content may be nullptr for a file that is not cached. Its hash is
+        known from a previous response, or the file is read for it only when the client sends a
+        validator (and is not too large). Otherwise there is no ETag, sendFileData() takes the hash.
+        @param[out] etag    HTTP_ETAG_SIZE bytes, empty string without ETag
+    */
+    void makeETag(FileSystem *fs, const char* path, const struct stat& st, const uint8_t* content, char* etag)
+    {
+        etag[0] = '\0';
+        if (st.st_mtime != 0) {
+            snprintf(etag, HTTP_ETAG_SIZE, "\"%lx-%lx\"", (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+            return;
+        }
+
+        uint32_t hash = HttpStringView::FNV_OFFSET_BASIS;
+        HttpFileCache& cache = _clientConnection->getServer()->getFileCache();
+        if (content) {
+            hash = HttpStringView((const char*)content, st.st_size).hash();
+        } else if (!cache.findHash(fs, path, st.st_size, &hash)) {
+            HttpParsedRequest* request = _clientConnection->getRequest();
+            if (request->get_header(HTTP_HEADER_IF_NONE_MATCH).empty() && request->get_header(HTTP_HEADER_IF_RANGE).empty())
+                return;
+            if ((size_t)st.st_size > HTTP_ETAG_HASH_MAX_SIZE)
+                return;
+
+            File file;
+            if (file.open(fs, path) != 0)
+                return;
+            char chunk[128];
+            ssize_t n;
+            while ((n = file.read(chunk, sizeof(chunk))) > 0) {
+                hash = HttpStringView(chunk, n).hash(hash);
+            }
+            file.close();
+            if (n < 0)
+                return;
+            cache.storeHash(fs, path, st.st_size, hash);
+        }
+
+        snprintf(etag, HTTP_ETAG_SIZE, "\"%lx-h%08lx\"", (unsigned long)st.st_size, (unsigned long)hash);
+    }
+
+    // Content-Type and encoding of a file that is not cached
+    void setFileHeaders(const string& filename, const FileVariant& variant)
+    {
+        const char* contentType = getContentType(getExtension(filename));
+        if (contentType)
+            headers.set("Content-Type", contentType);
+        if (variant.gzip)
+            headers.set("Content-Encoding", "gzip");
+    }
+
+    /*
+        Content-Type and encoding lines of a file, prepared for the cache entry
+    */
+    string getFileHeaders(const string& filename, const FileVariant& variant)
+    {
+        const char* contentType = getContentType(getExtension(filename));
+        string header;
+        if (contentType) {
+            header += "Content-Type:";
+            header += contentType;
+            header += "\r\n";
+        }
+        if (variant.gzip)
+            header += "Content-Encoding:gzip\r\n";
+        return header;
+    }
+
+    /*
+        read the file into the cache. Returns nullptr if the cache can't take the file
+    */
+    const HttpFileCacheEntry* loadFile(HttpFileCache& cache, FileSystem *fs, const string& filename, const FileVariant& variant, const struct stat& st)
+    {
+        HttpFileCacheEntry* entry = cache.create(fs, variant.path, st, getFileHeaders(filename, variant));
+        if (entry == nullptr)
+            return nullptr;
+
         File file;
-        int res = file.open(fs, filename.c_str());
+        if (file.open(fs, variant.path) != 0 ||
+            file.read(entry->content, entry->contentLength) != (ssize_t)entry->contentLength) {
+            file.close();
+            cache.discard(entry);
+            return nullptr;
+        }
+        file.close();
+        char etag[HTTP_ETAG_SIZE];
+        makeETag(fs, variant.path, st, entry->content, etag);
+        entry->etag = etag;
+
+        cache.add(entry);
+        return entry;
+    }
+
+    /*
+        Range: bytes=0-499, 1000-, -500
+        @return number of satisfiable ranges, 0 if none is satisfiable, -1 if the whole file is sent
+                (no or invalid Range header, too many ranges, If-Range does not match)
+    */
+    int getRanges(size_t fileSize, const char* etag, const struct stat& st, ByteRange* ranges)
+    {
+        HttpParsedRequest* request = _clientConnection->getRequest();
+        HttpStringView range = request->get_header(HTTP_HEADER_RANGE);
+        if (range.empty() || request->get_method() != HTTP_GET)
+            return -1;
+
+        // If-Range: the range is only valid for the same version of the file (strong comparison)
+        HttpStringView ifRange = trim(request->get_header(HTTP_HEADER_IF_RANGE));
+        if (!ifRange.empty()) {
+            time_t date;
+            if (ifRange.data[0] == '"') {
+                if (etag[0] == '\0' || !ifRange.equals(etag))
+                    return -1;
+            } else if (st.st_mtime == 0 || !httpParseDate(ifRange, &date) || date != st.st_mtime) {
+                return -1;
+            }
+        }
+
+        if (range.length < 6 || !HttpStringView(range.data, 6).equalsIgnoreCase("bytes="))
+            return -1;
+
+        int nRanges = 0;
+        int nSpecs = 0;
+        size_t pos = 6;
+        while (pos < range.length) {
+            size_t end = pos;
+            while (end < range.length && range.data[end] != ',')
+                end++;
+            HttpStringView spec = trim(HttpStringView(range.data + pos, end - pos));
+            pos = end + 1;
+            if (spec.empty())
+                continue;
+            nSpecs++;
+
+            size_t dash = 0;
+            while (dash < spec.length && spec.data[dash] != '-')
+                dash++;
+            if (dash == spec.length)
+                return -1;
+
+            HttpStringView firstText(spec.data, dash);
+            HttpStringView lastText(spec.data + dash + 1, spec.length - dash - 1);
+            uint64_t first, last;
+            if (firstText.empty()) {
+                // suffix: the last bytes
+                if (!parseNumber(lastText, &last))
+                    return -1;
+                if (last == 0 || fileSize == 0)
+                    continue;
+                first = fileSize - min((uint64_t)fileSize, last);
+                last = fileSize - 1;
+            } else {
+                if (!parseNumber(firstText, &first))
+                    return -1;
+                if (lastText.empty()) {
+                    last = fileSize - 1;
+                } else if (!parseNumber(lastText, &last) || last < first) {
+                    return -1;
+                }
+                if (first >= fileSize)
+                    continue;                                   // not satisfiable
+                last = min(last, (uint64_t)fileSize - 1);
+            }
 
-        uint16_t statusCode = 404;
-        
-        if(res == 0) {
-            fileSize = file.size();
+            if (nRanges == HTTP_MAX_RANGES)
+                return -1;                                      // too many, send the whole file
+            ranges[nRanges].offset = first;
+            ranges[nRanges].length = last - first + 1;
+            nRanges++;
+        }
+        return (nSpecs > 0) ? nRanges : -1;
+    }
 
-            if (filename.length() > 0) 
-                getStandardHeaders(filename.substr(filename.find_last_of(".")+1).c_str());
-            else
-                getStandardHeaders(nullptr);
+    static bool parseNumber(HttpStringView s, uint64_t* value)
+    {
+        if (s.empty() || s.length > 19)
+            return false;
+        *value = 0;
+        for (size_t i = 0; i < s.length; i++) {
+            if (s.data[i] < '0' || s.data[i] > '9')
+                return false;
+            *value = *value * 10 + (s.data[i] - '0');
+        }
+        return true;
+    }
 
-            headers["Content-Length"] = to_string(fileSize);
+    /*
+        send the header that buildHeader() made followed by the ranges of the file, from the cache entry or read
+        from the file. The output buffer of the connection joins header and data into full segments.
 
-            statusCode = 200;
+        @param[in] multipart    for multipart/byteranges, each range gets a part header and the last a trailer (may be nullptr)
+        @param[in] hashContent  the whole file is sent, keep its hash for the ETag (see makeETag())
+    */
+    nsapi_size_or_error_t sendFileData(FileSystem *fs, const char* path, const HttpFileCacheEntry* entry,
+                                       const ByteRange* ranges, int nRanges, const Multipart* multipart, bool hashContent)
+    {
+        if (entry && nRanges == 1 && multipart == nullptr && !isHeadRequest()) {
+            // header and cached content in one vectored send
+            HttpSendSegment segments[] = {
+                { _header, _headerLength },
+                { entry->content + ranges[0].offset, ranges[0].length }
+            };
+            return _clientConnection->sendv(segments, 2);
         }
 
-        debug("%s: send file: %s  size: %d Bytes\n", _clientConnection->getThreadname(), filename.c_str(), fileSize);
+        // file read buffers before the header, without them there is still a complete response
+        HttpFileReader& reader = _clientConnection->getFileReader();
+        HttpBufferPool& readPool = _clientConnection->getServer()->getFileReadPool();
+        uint8_t* readBuffers = nullptr;
+        if (entry == nullptr && !isHeadRequest()) {
+            size_t size;
+            readBuffers = readPool.alloc(0, &size);
+            if (readBuffers == nullptr) {
+                debug("%s: no file read buffers\n", _clientConnection->getThreadname());
+                static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                _clientConnection->setKeepAlive(false);
+                _clientConnection->send(response, sizeof(response) - 1);
+                return NSAPI_ERROR_NO_MEMORY;
+            }
+        }
 
-        nsapi_size_or_error_t sent = sendHeader(statusCode);
+        nsapi_size_or_error_t sent = _clientConnection->send(_header, _headerLength);
+        if (sent < 0 || isHeadRequest()) {
+            readPool.free(readBuffers);
+            return sent;
+        }
+
+        // the header is sent, after an error the response is incomplete and the connection must close
+        File file;
+        if (entry == nullptr && file.open(fs, path) != 0) {
+            _clientConnection->setKeepAlive(false);
+            readPool.free(readBuffers);
+            return NSAPI_ERROR_DEVICE_ERROR;
+        }
+
+        // file data is read ahead on the file reader thread while the previous buffer is sent
+        EventQueue* readerQueue = _clientConnection->getServer()->getFileReaderQueue();
+        HttpChunkSizer& sizer = _clientConnection->getServer()->getChunkSizer();
+        size_t chunkSize = entry ? 0 : sizer.getChunkSize(fs);
 
-        // send file chunks
         Timer t;
         t.start();
         auto tStart = t.elapsed_time();
-        if ((res == 0) && (sent > 0)) {
-            const size_t maxChunkSize = 1536;
-            char *chunkBuffer = new char[maxChunkSize];
-            MBED_ASSERT(chunkBuffer);
-            size_t bytesRead = 0;
+        size_t total = 0;
+        uint32_t hash = HttpStringView::FNV_OFFSET_BASIS;
+
+        for (int i = 0; (i < nRanges) && (sent >= 0); i++) {
+            if (multipart) {
+                char partHeader[HTTP_PART_HEADER_SIZE];
+                sent = _clientConnection->send(partHeader, formatPartHeader(partHeader, *multipart, ranges[i]));
+            }
+
+            if (entry) {
+                if (sent >= 0)
+                    sent = _clientConnection->send((const char*)entry->content + ranges[i].offset, ranges[i].length);
+                total += ranges[i].length;
+                continue;
+            }
 
-            while (bytesRead < fileSize) {
-                size_t chunkSize = min(fileSize - bytesRead, maxChunkSize);
-                size_t n = file.read(chunkBuffer, chunkSize);
-                if (n != chunkSize) {
-                    int err = errno;
-                    debug("%s: Error reading file: %s  chunksize: %d Bytes read Bytes %d errno: %d\n", 
-                        _clientConnection->getThreadname(), filename.c_str(), chunkSize, n, err);
-                    file.close();
-                    delete[] chunkBuffer;
-                    return err;
+            if (ranges[i].offset > 0 && file.seek(ranges[i].offset, SEEK_SET) != (off_t)ranges[i].offset) {
+                _clientConnection->setKeepAlive(false);
+                sent = NSAPI_ERROR_DEVICE_ERROR;
+                break;
+            }
+
+            reader.begin(readerQueue, &file, ranges[i].offset, ranges[i].length, chunkSize, readBuffers);
+            size_t bytesRead = 0;
+            while ((bytesRead < ranges[i].length) && (sent >= 0)) {
+                const uint8_t* data;
+                ssize_t n = reader.next(&data);
+                if (n <= 0) {
+                    debug("%s: Error reading file: %s  offset: %d error: %d\n",
+                        _clientConnection->getThreadname(), path, ranges[i].offset + bytesRead, n);
+                    _clientConnection->setKeepAlive(false);
+                    sent = NSAPI_ERROR_DEVICE_ERROR;
+                    break;
                 }
-                nsapi_size_or_error_t sent = _clientConnection->send(chunkBuffer,  n);
-                if (sent > 0)
-                    bytesRead += n;
+                if (hashContent)
+                    hash = HttpStringView((const char*)data, n).hash(hash);
+                sent = _clientConnection->send((const char*)data, n);
+                reader.release();
+                bytesRead += n;
             }
-            delete[] chunkBuffer;
+            reader.end();
+            total += bytesRead;
         }
 
-        if (res == 0) {
+        if (multipart && sent >= 0)
+            sent = _clientConnection->send(HTTP_BYTERANGES_TRAILER, sizeof(HTTP_BYTERANGES_TRAILER) - 1);
+
+        if (entry == nullptr)
             file.close();
-        }
+        readPool.free(readBuffers);
 
         auto tStop = t.elapsed_time();
         long tDiff = (tStop - tStart).count();
-        debug("%s:  file sent %.2f ms  %.2f kB/s\n", _clientConnection->getThreadname(), tDiff / 1000.0f, (fileSize / 1.024f) / (tDiff / 1000.0f));
+        debug("%s:  file sent %.2f ms  %.2f kB/s\n", _clientConnection->getThreadname(), tDiff / 1000.0f, (total / 1.024f) / (tDiff / 1000.0f));
+        if (entry == nullptr) {
+            _clientConnection->countFileSent(total, tStop - tStart);
+            if (sent >= 0)
+                sizer.report(fs, chunkSize, total, tStop - tStart);
+            if (hashContent && sent >= 0)
+                _clientConnection->getServer()->getFileCache().storeHash(fs, path, total, hash);
+        }
 
-        return fileSize;
+        return sent;
     }
 
-    nsapi_error_t sendContent(uint16_t statusCode, string content, const char* contentType = "text/html; charset=utf-8") 
+    // text after the last dot, the whole name if there is none. nullptr for an empty name
+    static const char* getExtension(const string& filename)
     {
-        headers["Content-Type"] = contentType;
-        headers["Content-Length"] = to_string(content.length());
-
-        nsapi_size_or_error_t sent = sendHeader(statusCode);
-        if (sent >= 0) {
-            sent = _clientConnection->send(content.c_str(), content.length());
-        }
-
-        return sent;
+        if (filename.empty())
+            return nullptr;
+        size_t dot = filename.find_last_of(".");
+        return filename.c_str() + ((dot == string::npos) ? 0 : dot + 1);
     }
 
-private:
-    void getStandardHeaders(const char* fext)
+    const char* getContentType(const char* fext)
     {
         if (fext == nullptr)
-            headers["Content-Type"] = "text/html; charset=utf-8";
-        else {
-            for (size_t i = 0; i < sizeof(fileTypeMapping)/sizeof(struct mapping_t); i++) {
-                if (_stricmp(fileTypeMapping[i].key, fext) == 0) {
-                    headers["Content-Type"] = fileTypeMapping[i].value;
-                    break;
-                }
+            return "text/html; charset=utf-8";
+
+        for (size_t i = 0; i < sizeof(fileTypeMapping)/sizeof(struct mapping_t); i++) {
+            if (_stricmp(fileTypeMapping[i].key, fext) == 0) {
+                return fileTypeMapping[i].value;
             }
         }
+        return nullptr;
     }
 
     int _stricmp(const char* a, const char* b)
@@ -262,7 +1062,18 @@ private:
 
     ClientConnection* _clientConnection;
     const char* status_message;
-    string  _buffer;
+    char* _headerBuffer;
+    size_t _headerBufferSize;
+    uint8_t* _pooledHeaderBuffer;                       // _headerBuffer if it is from the pool
+    const char* _header;                                // of the last buildHeader(), in _headerBuffer
+    size_t _headerLength;
+    const char* _headerBlock;
+    size_t _headerBlockLength;
+    char* _chunkBuffer;                                 // streamed response: size line, content, CRLF. From the send buffer pool
+    size_t _chunkLength;                                // content in _chunkBuffer
+    bool _streaming;
+    bool _chunked;                                      // else the content is delimited by closing the connection
+    nsapi_error_t _streamError;
 };
 
 #endif // _MBED_HTTP_RESPONSE_BUILDER_
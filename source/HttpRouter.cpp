@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "HttpRouter.h"
+
+HttpRouter::HttpRouter()
+{
+}
+
+HttpRouter::HttpRouter(const HttpRouter& other)
+{
+    copyNode(&_root, &other._root);
+}
+
+HttpRouter::~HttpRouter()
+{
+}
+
+HttpRouter::Node* HttpRouter::copyNode(const Node* node)
+{
+    if (node == nullptr) {
+        return nullptr;
+    }
+
+    Node* copy = new Node();
+    MBED_ASSERT(copy);
+    copyNode(copy, node);
+    return copy;
+}
+
+void HttpRouter::copyNode(Node* copy, const Node* node)
+{
+    copy->prefix = node->prefix;
+    copy->name = node->name;
+    for (const Node* child : node->children) {
+        copy->children.push_back(copyNode(child));
+    }
+    copy->paramChild = copyNode(node->paramChild);
+    copy->wildcardChild = copyNode(node->wildcardChild);
+    for (const HTTPRoute* route : node->routes) {
+        copy->routes.push_back(new HTTPRoute(*route));
+    }
+    for (const HTTPRoute* route : node->dirRoutes) {
+        copy->dirRoutes.push_back(new HTTPRoute(*route));
+    }
+}
+
+HttpRouter::Node::~Node()
+{
+    for (Node* child : children) {
+        delete child;
+    }
+    delete paramChild;
+    delete wildcardChild;
+    for (HTTPRoute* route : routes) {
+        delete route;
+    }
+    for (HTTPRoute* route : dirRoutes) {
+        delete route;
+    }
+}
+
+HTTPRoute& HttpRouter::add(const char* pattern, int method)
+{
+    size_t length = strlen(pattern);
+    Node* node = insert(pattern);
+    bool isDirectory = (length > 0) && (pattern[length - 1] == '/') && (node != &_root);
+    std::vector<HTTPRoute*>& routes = isDirectory ? node->dirRoutes : node->routes;
+
+    for (HTTPRoute* route : routes) {
+        if (route->method == method) {
+            return *route;
+        }
+    }
+
+    HTTPRoute* route = new HTTPRoute();
+    MBED_ASSERT(route);
+    route->method = method;
+    route->wsHandler = nullptr;
+    routes.push_back(route);
+    return *route;
+}
+
+/*
+    split the pattern into static text and parameter segments and walk or extend the tree
+*/
+HttpRouter::Node* HttpRouter::insert(const char* pattern)
+{
+    Node* node = &_root;
+    const char* p = pattern;
+
+    while (*p) {
+        bool segmentStart = (p > pattern) && (p[-1] == '/');
+
+        if (segmentStart && (*p == ':' || *p == '*')) {
+            bool isWildcard = (*p == '*');
+            const char* nameEnd = p + 1;
+            while (*nameEnd && (isWildcard || *nameEnd != '/')) {
+                nameEnd++;
+            }
+
+            Node*& child = isWildcard ? node->wildcardChild : node->paramChild;
+            if (child == nullptr) {
+                child = new Node();
+                MBED_ASSERT(child);
+                child->name.assign(p + 1, nameEnd - p - 1);
+            }
+            // one parameter node per position, a different name at the same position keeps the first name
+            node = child;
+            p = nameEnd;
+            continue;
+        }
+
+        const char* end = p + 1;
+        while (*end && !((end[-1] == '/') && (*end == ':' || *end == '*'))) {
+            end++;
+        }
+        node = insertStatic(node, p, end - p);
+        p = end;
+    }
+    return node;
+}
+
+HttpRouter::Node* HttpRouter::insertStatic(Node* node, const char* text, size_t length)
+{
+    while (length > 0) {
+        Node* child = nullptr;
+        size_t childIndex = 0;
+        for (; childIndex < node->children.size(); childIndex++) {
+            if (node->children[childIndex]->prefix[0] == text[0]) {
+                child = node->children[childIndex];
+                break;
+            }
+        }
+
+        if (child == nullptr) {
+            child = new Node();
+            MBED_ASSERT(child);
+            child->prefix.assign(text, length);
+            node->children.push_back(child);
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < length && common < child->prefix.length() && child->prefix[common] == text[common]) {
+            common++;
+        }
+
+        if (common < child->prefix.length()) {
+            // split the child, the common part becomes the new parent
+            Node* parent = new Node();
+            MBED_ASSERT(parent);
+            parent->prefix = child->prefix.substr(0, common);
+            child->prefix.erase(0, common);
+            parent->children.push_back(child);
+            node->children[childIndex] = parent;
+            child = parent;
+        }
+
+        node = child;
+        text += common;
+        length -= common;
+    }
+    return node;
+}
+
+const HTTPRoute* HttpRouter::find(HttpStringView path, int method, bool webSocket, HttpParsedRequest* request) const
+{
+    if (request) {
+        request->clear_params();
+    }
+    return match(&_root, path, 0, method, webSocket, request);
+}
+
+/*
+    path[0..pos) is matched by node, try the rest in the order of priority
+*/
+const HTTPRoute* HttpRouter::match(const Node* node, HttpStringView path, size_t pos, int method, bool webSocket, HttpParsedRequest* request) const
+{
+    const HTTPRoute* route;
+    size_t remaining = path.length - pos;
+    bool segmentStart = (pos > 0) && (path.data[pos - 1] == '/');
+
+    if (remaining == 0) {
+        route = selectRoute(node->routes, method, webSocket);
+        if (route == nullptr) {
+            route = selectRoute(node->dirRoutes, method, webSocket);
+        }
+        if (route == nullptr && segmentStart && node->wildcardChild) {
+            route = selectRoute(node->wildcardChild->routes, method, webSocket);
+            if (route && request) {
+                request->add_param(node->wildcardChild->name.c_str(), HttpStringView(path.data + pos, 0));
+            }
+        }
+        return route;
+    }
+
+    // static
+    for (const Node* child : node->children) {
+        if (child->prefix[0] == path.data[pos]) {
+            size_t length = child->prefix.length();
+            if (length <= remaining && memcmp(child->prefix.data(), path.data + pos, length) == 0) {
+                route = match(child, path, pos + length, method, webSocket, request);
+                if (route) {
+                    return route;
+                }
+            }
+            break;
+        }
+    }
+
+    // find end of the current segment
+    size_t segmentEnd = pos;
+    while (segmentEnd < path.length && path.data[segmentEnd] != '/') {
+        segmentEnd++;
+    }
+
+    // :name
+    if (segmentStart && node->paramChild && segmentEnd > pos) {
+        route = match(node->paramChild, path, segmentEnd, method, webSocket, request);
+        if (route) {
+            if (request) {
+                request->add_param(node->paramChild->name.c_str(), HttpStringView(path.data + pos, segmentEnd - pos));
+            }
+            return route;
+        }
+    }
+
+    // directory route, one file name is left
+    if (segmentEnd == path.length) {
+        route = selectRoute(node->dirRoutes, method, webSocket);
+        if (route) {
+            return route;
+        }
+    }
+
+    // *name
+    if (segmentStart && node->wildcardChild) {
+        route = selectRoute(node->wildcardChild->routes, method, webSocket);
+        if (route) {
+            if (request) {
+                request->add_param(node->wildcardChild->name.c_str(), HttpStringView(path.data + pos, remaining));
+            }
+            return route;
+        }
+    }
+
+    return nullptr;
+}
+
+/*
+    a route for the method is preferred over a route for any method, otherwise the first candidate in
+    the order the routes were added is taken. HEAD requests use the GET route if there is no HEAD
+    route, the response builder omits the body. HttpStaticRouteTable::find() uses the same order.
+*/
+const HTTPRoute* HttpRouter::selectRoute(const std::vector<HTTPRoute*>& routes, int method, bool webSocket)
+{
+    const HTTPRoute* otherMethodRoute = nullptr;
+
+    for (const HTTPRoute* route : routes) {
+        if (webSocket ? (route->wsHandler == nullptr) : !route->handler) {
+            continue;
+        }
+        if (route->method == method) {
+            return route;
+        }
+        if (route->method == HTTP_ANY_METHOD || method == HTTP_ANY_METHOD ||
+            (method == HTTP_HEAD && route->method == HTTP_GET)) {
+            otherMethodRoute = otherMethodRoute ? otherMethodRoute : route;
+        }
+    }
+    return otherMethodRoute;
+}
+
+const HTTPRoute* HttpRouteTable::findHTTPRoute(HttpParsedRequest* request) const
+{
+    const HTTPRoute* route = router.find(request->get_path_view(), request->get_method(), false, request);
+    if (route == nullptr) {
+        // if no matching route is found, use the root handler
+        route = router.find("/", request->get_method(), false);
+    }
+    return route;
+}
+
+const HttpStaticRoute* HttpRouteTable::findStaticRoute(HttpParsedRequest* request) const
+{
+    if (staticRoutes == nullptr) {
+        return nullptr;
+    }
+    return staticRoutes->find(request->get_path_view(), request->get_method(), false);
+}
+
+CreateWSHandlerFn HttpRouteTable::findWSHandler(HttpParsedRequest* request) const
+{
+    if (staticRoutes) {
+        const HttpStaticRoute* staticRoute = staticRoutes->find(request->get_path_view(), request->get_method(), true);
+        if (staticRoute) {
+            return staticRoute->wsHandler;
+        }
+    }
+
+    const HTTPRoute* route = router.find(request->get_path_view(), request->get_method(), true, request);
+    return route ? route->wsHandler : nullptr;
+}
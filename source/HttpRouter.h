@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __HttpRouter_h__
+#define __HttpRouter_h__
+
+#include "mbed.h"
+#include "HTTPHandler.h"
+#include "HttpStaticRoutes.h"
+#include "HttpStringView.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * \brief radix tree of routes, selected by path and method.
+ *
+ * Path patterns:
+ *  - "/api/status"         static path, exact match
+ *  - "/api/sensor/:id"     :name matches one path segment, the value is available with HttpParsedRequest::get_param("id")
+ *  - "/files/\*path"       *name matches the rest of the path (may be empty), must be the last segment
+ *  - "/www/"               ends with '/': matches the directory itself and every file in it (but not subdirectories)
+ *
+ * When several routes match, static segments win over :name, :name over a directory route and
+ * a directory route over *name. Lookup is linear in the path length and does not allocate.
+ * Adding is not thread safe against concurrent lookups, HttpServer changes a copy (see HttpRouteTable).
+ */
+class HttpRouter {
+public:
+    HttpRouter();
+    HttpRouter(const HttpRouter& other);
+    ~HttpRouter();
+
+    /**
+     * get the route for pattern and method, a new empty route is created if it does not exist yet
+     *
+     * @param[in] pattern  path pattern, must start with '/'
+     * @param[in] method   http_method or HTTP_ANY_METHOD
+     */
+    HTTPRoute& add(const char* pattern, int method);
+
+    /**
+     * find the route for a request path
+     *
+     * @param[in]  path       path without query
+     * @param[in]  method     request method, HTTP_ANY_METHOD matches routes of all methods
+     * @param[in]  webSocket  true: only routes with a websocket handler, false: only routes with a request handler
+     * @param[out] request    captured path parameters are added to the request, may be nullptr.
+     *                        path must be a view into the request buffer in this case
+     * @return route or nullptr
+     */
+    const HTTPRoute* find(HttpStringView path, int method, bool webSocket, HttpParsedRequest* request = nullptr) const;
+
+private:
+    struct Node {
+        Node() : paramChild(nullptr), wildcardChild(nullptr) {}
+        ~Node();
+
+        std::string prefix;                 // static path part, compressed
+        std::vector<Node*> children;        // static children, each starts with a different character
+        Node* paramChild;                   // :name segment
+        Node* wildcardChild;                // *name rest of path
+        std::string name;                   // parameter name of :name and *name nodes
+        std::vector<HTTPRoute*> routes;     // routes ending here
+        std::vector<HTTPRoute*> dirRoutes;  // directory routes ending here, match one more file name
+    };
+
+    // nodes are owned, only copy construction is supported
+    HttpRouter& operator=(const HttpRouter&);
+
+    static Node* copyNode(const Node* node);
+    static void copyNode(Node* copy, const Node* node);
+    Node* insert(const char* pattern);
+    Node* insertStatic(Node* node, const char* text, size_t length);
+    const HTTPRoute* match(const Node* node, HttpStringView path, size_t pos, int method, bool webSocket, HttpParsedRequest* request) const;
+    static const HTTPRoute* selectRoute(const std::vector<HTTPRoute*>& routes, int method, bool webSocket);
+
+    Node _root;
+};
+
+/**
+ * \brief immutable set of all routes of a server.
+ *
+ * HttpServer publishes the current table with an atomic pointer swap. Changes are made on a
+ * copy, a replaced table is deleted when no client connection uses it anymore.
+ */
+class HttpRouteTable {
+public:
+    HttpRouteTable() : staticRoutes(nullptr) {}
+
+    // route for a request by path and method, falls back to the root route
+    const HTTPRoute* findHTTPRoute(HttpParsedRequest* request) const;
+    const HttpStaticRoute* findStaticRoute(HttpParsedRequest* request) const;
+    CreateWSHandlerFn findWSHandler(HttpParsedRequest* request) const;
+
+    HttpRouter router;
+    const HttpStaticRouteTable* staticRoutes;           // optional, generated routes
+};
+
+#endif
@@ -24,30 +24,112 @@
  * @param[in] network The network interface
 */
 HttpServer::HttpServer(NetworkInterface* network, int nWorkerThreads, int nWebSocketsMax)  :
-    _threadHTTPServer(osPriorityNormal, 2*1024, nullptr, "HTTPServerThread") { 
+    _threadHTTPServer(osPriorityNormal, 2*1024, nullptr, "HTTPServerThread"),
+    _fileCache(HTTP_FILE_CACHE_SIZE, HTTP_FILE_CACHE_MAX_FILE_SIZE) { 
     _network = network;
     _nWebSockets = 0;
     _nWebSocketsMax = nWebSocketsMax;
     _nWorkerThreads = nWorkerThreads;
+    _idleConnections = nullptr;
+    _routes = new HttpRouteTable();
+    MBED_ASSERT(_routes);
+    _retiredCount = 0;
+    _routeChanges = nullptr;
+    _routeChangeDepth = 0;
+    _standardHeaderBlock = new std::string();
+    MBED_ASSERT(_standardHeaderBlock);
+    _retiredHeaderCount = 0;
+    _started = false;
+    _pendingHead = 0;
+    _pendingCount = 0;
+    _fileReaderQueue = nullptr;
+    _fileReaderThread = nullptr;
+    memset(&_stats, 0, sizeof(_stats));
 }
 
 HttpServer::~HttpServer() {
     debug("HTTPServer shutdown\n");
+
+    for (HttpRouteTable* routes : _retiredRoutes) {
+        delete routes;
+    }
+    delete _routes;
+
+    for (std::string* block : _retiredHeaderBlocks) {
+        delete block;
+    }
+    delete _standardHeaderBlock;
 }
 
 /**
  * Start running the server (it will run on it's own thread)
  */
 nsapi_error_t HttpServer::start(uint16_t port) {
+    // from now on connections read the routes, changes are made on a copy
+    _routeMutex.lock();
+    _started = true;
+    _routeMutex.unlock();
+
+    // one small receive buffer for each connection, a few large ones are shared
+    if (!_bufferPool.init(_nWorkerThreads, HTTP_SMALL_BUFFER_SIZE, HTTP_LARGE_BUFFER_COUNT, HTTP_RECEIVE_BUFFER_SIZE)) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    // output, response header and chunk buffers in their own pool, one of each per thread that handles
+    // requests. A connection without output buffer sends unbuffered, so output can never take the receive
+    // buffer of a new connection
+    int nThreads = HTTP_EVENT_DRIVEN ? HTTP_EVENT_THREADS : _nWorkerThreads;
+    size_t sendBufferSize = max(max((size_t)HTTP_SMALL_BUFFER_SIZE, (size_t)HTTP_RESPONSE_HEADER_SIZE), (size_t)HTTP_CHUNK_BUFFER_SIZE);
+    if (!_sendBufferPool.init(3 * nThreads, sendBufferSize, 0, sendBufferSize)) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    // file read buffers, held while a file is sent
+    size_t fileReadSize = HTTP_FILE_READ_BUFFER_COUNT * HTTP_FILE_READ_BUFFER_SIZE;
+    if (!_fileReadPool.init(nThreads, fileReadSize, 0, fileReadSize)) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    // request bodies, held from the headers until the request is handled
+    if (!_bodyPool.init(nThreads, HTTP_BODY_ARENA_SIZE, 0, HTTP_BODY_ARENA_SIZE)) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+#if HTTP_EVENT_DRIVEN
+    // event driven: a few threads service all connections, each connection is bound to one queue
+    // queue needs room for one periodic and one pending event per connection
+    int nConnectionsPerQueue = (_nWorkerThreads + HTTP_EVENT_THREADS - 1) / HTTP_EVENT_THREADS;
+    for(int i=0; i < HTTP_EVENT_THREADS; i++) {
+        string *threadName = new string;
+        *threadName = "HTTPEventThread_" + to_string(i);
+        EventQueue *queue = new EventQueue((2 * nConnectionsPerQueue + 4) * EVENTS_EVENT_SIZE);
+        Thread *thread = new Thread(osPriorityAboveNormal, 3*1024, nullptr, threadName->c_str());
+        MBED_ASSERT(queue && thread);
+        thread->start(callback(queue, &EventQueue::dispatch_forever));
+        _eventQueues.push_back(queue);
+        _eventThreads.push_back(thread);
+    }
+#endif
+
+#if HTTP_FILE_READ_BUFFERS > 1
+    // one thread reads files for all connections, a connection has at most one pending read
+    _fileReaderQueue = new EventQueue((_nWorkerThreads + 2) * EVENTS_EVENT_SIZE);
+    _fileReaderThread = new Thread(osPriorityAboveNormal, 3*1024, nullptr, "HTTPFileReaderThread");
+    MBED_ASSERT(_fileReaderQueue && _fileReaderThread);
+    _fileReaderThread->start(callback(_fileReaderQueue, &EventQueue::dispatch_forever));
+#endif
+
     // create client connections
     // needs RAM for buffers!
     _clientConnections.reserve(_nWorkerThreads);
     for(int i=0; i < _nWorkerThreads; i++) {
         string *threadName = new string;
         *threadName = "HTTPClientThread_" + to_string(i);
-        ClientConnection *clientCon = new ClientConnection(this, threadName->c_str());
+        EventQueue *queue = _eventQueues.empty() ? nullptr : _eventQueues[i % _eventQueues.size()];
+        ClientConnection *clientCon = new ClientConnection(this, threadName->c_str(), queue);
         MBED_ASSERT(clientCon);
         _clientConnections.push_back(clientCon);
+        pushIdleConnection(clientCon);
     }
 
     // create server socket and start to listen
@@ -75,40 +157,151 @@ nsapi_error_t HttpServer::start(uint16_t port) {
 
 void HttpServer::main() {
     while (1) {
+        // wait for new connections, but wakeup in time to drop waiting sockets that are too old
+        _connectionMutex.lock();
+        expirePendingConnections();
+        if (_pendingCount > 0) {
+            auto waited = Kernel::Clock::now() - _pendingConnections[_pendingHead].acceptTime;
+            auto remaining = milliseconds(HTTP_ACCEPT_QUEUE_TIMEOUT) - duration_cast<milliseconds>(waited);
+            _serverSocket->set_timeout(max((int)remaining.count(), 1));
+        } else {
+            _serverSocket->set_blocking(true);
+        }
+        _connectionMutex.unlock();
+
         nsapi_error_t accept_res = -1;
         TCPSocket* clt_sock = _serverSocket->accept(&accept_res);
         if (accept_res == NSAPI_ERROR_OK) {
-            // find idle client connection
-            vector<ClientConnection*>::iterator it = _clientConnections.begin();
-            while (((*it)->isIdle() == false) && (it < _clientConnections.end())) {
-                 it++;
+            // fast path, take an idle client connection without locking
+            ClientConnection* idleConnection = popIdleConnection();
+            if (idleConnection) {
+                startConnection(idleConnection, clt_sock);
+                continue;
             }
-            
-            if ((*it)->isIdle()) {
-                (*it)->start(clt_sock);
-            } else
-            {
-                clt_sock->close();               // no idle connections, close. Todo: wait with timeout
+
+            // a connection may have become idle meanwhile, check again while releaseConnection() is locked out
+            ScopedLock<Mutex> lock(_connectionMutex);
+            idleConnection = popIdleConnection();
+            if (idleConnection) {
+                startConnection(idleConnection, clt_sock);
+            } else if (_pendingCount < HTTP_ACCEPT_QUEUE_SIZE) {
+                // all busy, wait for the next connection to become idle
+                int tail = (_pendingHead + _pendingCount) % (HTTP_ACCEPT_QUEUE_SIZE + 1);
+                _pendingConnections[tail].socket = clt_sock;
+                _pendingConnections[tail].acceptTime = Kernel::Clock::now();
+                _pendingCount++;
+                _stats.acceptQueued++;
+            } else {
+                clt_sock->close();               // no idle connections and queue full, close
+                _stats.acceptRejected++;
             }
-            
         }
     }
 }
 
+void HttpServer::releaseConnection(ClientConnection* clientConnection)
+{
+    ScopedLock<Mutex> lock(_connectionMutex);
+
+    TCPSocket* socket;
+    while ((socket = popPendingConnection()) != nullptr) {
+        if (clientConnection->start(socket))
+            return;
+        _stats.acceptRejected++;
+    }
+    pushIdleConnection(clientConnection);
+}
+
+/*
+    start an idle connection from the accept thread. If it cannot start, the socket is closed already
+*/
+void HttpServer::startConnection(ClientConnection* clientConnection, TCPSocket* socket)
+{
+    if (!clientConnection->start(socket)) {
+        _stats.acceptRejected++;
+        pushIdleConnection(clientConnection);
+    }
+}
+
+void HttpServer::pushIdleConnection(ClientConnection* clientConnection)
+{
+    clientConnection->setIdle();
+
+    void* head = core_util_atomic_load_ptr((void**)&_idleConnections);
+    do {
+        clientConnection->_nextIdle = (ClientConnection*)head;
+    } while (!core_util_atomic_cas_ptr((void**)&_idleConnections, &head, clientConnection));
+}
+
+/*
+    only called from the accept thread. With a single consumer a popped entry cannot be pushed again
+    before the CAS completes, so there is no ABA problem.
+*/
+ClientConnection* HttpServer::popIdleConnection()
+{
+    void* head = core_util_atomic_load_ptr((void**)&_idleConnections);
+    while (head && !core_util_atomic_cas_ptr((void**)&_idleConnections, &head, ((ClientConnection*)head)->_nextIdle)) {
+    }
+    return (ClientConnection*)head;
+}
+
+/*
+    remove the oldest socket from the accept queue, sockets that have waited too long are closed.
+    _connectionMutex must be locked
+*/
+TCPSocket* HttpServer::popPendingConnection()
+{
+    expirePendingConnections();
+    if (_pendingCount == 0)
+        return nullptr;
+
+    TCPSocket* socket = _pendingConnections[_pendingHead].socket;
+    _pendingHead = (_pendingHead + 1) % (HTTP_ACCEPT_QUEUE_SIZE + 1);
+    _pendingCount--;
+    return socket;
+}
+
+/*
+    _connectionMutex must be locked
+*/
+void HttpServer::expirePendingConnections()
+{
+    auto now = Kernel::Clock::now();
+    while (_pendingCount > 0) {
+        PendingConnection& pending = _pendingConnections[_pendingHead];
+        if (now - pending.acceptTime < milliseconds(HTTP_ACCEPT_QUEUE_TIMEOUT))
+            break;
+
+        pending.socket->close();
+        _pendingHead = (_pendingHead + 1) % (HTTP_ACCEPT_QUEUE_SIZE + 1);
+        _pendingCount--;
+        _stats.acceptExpired++;
+    }
+}
+
+HttpServerStats HttpServer::getStats()
+{
+    ScopedLock<Mutex> lock(_connectionMutex);
+    HttpServerStats stats = _stats;
+    size_t blockSize, chunkSize;
+    _chunkSizer.getStats(&blockSize, &chunkSize, &stats.fileThroughput);
+    stats.fileBlockSize = blockSize;
+    stats.fileChunkSize = chunkSize;
+    return stats;
+}
+
 void HttpServer::setWSHandler(const char* path, CreateWSHandlerFn handler)
 {
-	_WSHandlers[path] = handler;
+    HttpRouteTable* routes = beginRouteUpdate();
+    routes->router.add(path, HTTP_GET).wsHandler = handler;
+    publishRoutes(routes);
 }
 
 CreateWSHandlerFn HttpServer::getWSHandler(const char* path)
 {
-	WebSocketHandlerContainer::iterator it;
-
-	it = _WSHandlers.find(path);
-	if (it != _WSHandlers.end()) {
-		return it->second;
-	}
-	return nullptr;
+    ScopedLock<Mutex> lock(_routeMutex);                // routes are not deleted while locked
+    const HTTPRoute* route = _routes->router.find(path, HTTP_GET, true);
+    return route ? route->wsHandler : nullptr;
 }
 
 void HttpServer::wsSendTextAll(const char *origin, const char *text, int length)
@@ -125,40 +318,244 @@ void HttpServer::wsSendTextAll(const char *origin, const char *text, int length)
 
 void HttpServer::setHTTPHandler(const char* path, CallbackRequestHandler handler)
 {
-	_HTTPHandlers[path] = handler;
+    HttpRouteTable* routes = beginRouteUpdate();
+    routes->router.add(path, HTTP_ANY_METHOD).handler = handler;
+    publishRoutes(routes);
+}
+
+void HttpServer::setHTTPHandler(const char* path, CallbackRequestHandler handler, std::initializer_list<const char*> headers)
+{
+    HttpRouteTable* routes = beginRouteUpdate();
+    HTTPRoute& route = routes->router.add(path, HTTP_ANY_METHOD);
+    route.handler = handler;
+    route.headerFilter = HttpHeaderFilter(headers);
+    publishRoutes(routes);
+}
+
+void HttpServer::setHTTPHandler(http_method method, const char* path, CallbackRequestHandler handler)
+{
+    HttpRouteTable* routes = beginRouteUpdate();
+    routes->router.add(path, method).handler = handler;
+    publishRoutes(routes);
+}
+
+void HttpServer::setHTTPHandler(http_method method, const char* path, CallbackRequestHandler handler, std::initializer_list<const char*> headers)
+{
+    HttpRouteTable* routes = beginRouteUpdate();
+    HTTPRoute& route = routes->router.add(path, method);
+    route.handler = handler;
+    route.headerFilter = HttpHeaderFilter(headers);
+    publishRoutes(routes);
+}
+
+void HttpServer::setHTTPBodyHandler(const char* path, CallbackBodyBegin begin, CallbackBodyChunk chunk, CallbackBodyEnd end,
+                                    CallbackBodyAbort abort)
+{
+    HttpRouteTable* routes = beginRouteUpdate();
+    HTTPBodyHandler& body = routes->router.add(path, HTTP_ANY_METHOD).body;
+    body.begin = begin;
+    body.chunk = chunk;
+    body.end = end;
+    body.abort = abort;
+    publishRoutes(routes);
 }
 
+void HttpServer::setHTTPBodyHandler(http_method method, const char* path, CallbackBodyBegin begin, CallbackBodyChunk chunk, CallbackBodyEnd end,
+                                    CallbackBodyAbort abort)
+{
+    HttpRouteTable* routes = beginRouteUpdate();
+    HTTPBodyHandler& body = routes->router.add(path, method).body;
+    body.begin = begin;
+    body.chunk = chunk;
+    body.end = end;
+    body.abort = abort;
+    publishRoutes(routes);
+}
 
 CallbackRequestHandler HttpServer::getHTTPHandler(const char* url)
 {
-	HTTPSocketHandlerContainer::iterator it;
+    HttpStringView path(url);
+    const char* query = strchr(url, '?');
+    if (query) {
+        path.length = query - url;
+    }
 
-    string path(url);
-    size_t found = path.find_last_of("/");
-    if(found) {
-        path.erase(found+1, path.length());
+    ScopedLock<Mutex> lock(_routeMutex);                // routes are not deleted while locked
+    const HTTPRoute* route = _routes->router.find(path, HTTP_ANY_METHOD, false);
+    if (route == nullptr) {
+        route = _routes->router.find("/", HTTP_ANY_METHOD, false);
     }
+    return route ? route->handler : nullptr;
+}
 
-	it = _HTTPHandlers.find(path);
-	if (it != _HTTPHandlers.end()) {
-		return it->second;
-	}
-    // if no matching handler is found, return 1st (root handler)
-    if (_HTTPHandlers.size() > 0) {
-    	it = _HTTPHandlers.begin();
-        return it->second;
+void HttpServer::setStaticRoutes(const HttpStaticRouteTable* staticRoutes)
+{
+    HttpRouteTable* routes = beginRouteUpdate();
+    routes->staticRoutes = staticRoutes;
+    publishRoutes(routes);
+}
+
+/*
+    publish the snapshot in the hazard pointer of the connection, then check that it is still current.
+    Otherwise it may have been retired (and deleted) before the hazard pointer was visible, try again.
+*/
+template <typename T>
+T* HttpServer::acquireSnapshot(T** current, const T** hazard)
+{
+    void* snapshot = core_util_atomic_load_ptr((void**)current);
+    while (true) {
+        core_util_atomic_store_ptr((void**)hazard, snapshot);
+        void* now = core_util_atomic_load_ptr((void**)current);
+        if (now == snapshot) {
+            return (T*)snapshot;
+        }
+        snapshot = now;
+    }
+}
+
+/*
+    delete the retired snapshots that no connection uses. The mutex of the snapshot must be locked
+*/
+template <typename T>
+void HttpServer::reclaimSnapshots(vector<T*>& retired, int32_t* retiredCount, const T* ClientConnection::*hazard)
+{
+    for (size_t i = 0; i < retired.size(); ) {
+        bool inUse = false;
+        for (ClientConnection* clientConnection : _clientConnections) {
+            if (core_util_atomic_load_ptr((void**)&(clientConnection->*hazard)) == retired[i]) {
+                inUse = true;
+                break;
+            }
+        }
+
+        if (inUse) {
+            i++;
+        } else {
+            delete retired[i];
+            retired[i] = retired.back();
+            retired.pop_back();
+        }
+    }
+    core_util_atomic_store_s32(retiredCount, retired.size());
+}
+
+const HttpRouteTable* HttpServer::acquireRoutes(ClientConnection* clientConnection)
+{
+    return acquireSnapshot(&_routes, &clientConnection->_routesInUse);
+}
+
+void HttpServer::releaseRoutes(ClientConnection* clientConnection)
+{
+    core_util_atomic_store_ptr((void**)&clientConnection->_routesInUse, nullptr);
+
+    // the last user of a replaced table frees it, unless a change is running anyway
+    if (core_util_atomic_load_s32(&_retiredCount) > 0 && _routeMutex.trylock()) {
+        reclaimRoutes();
+        _routeMutex.unlock();
     }
-    else	
-        return nullptr;
+}
+
+const std::string* HttpServer::acquireStandardHeaders(ClientConnection* clientConnection)
+{
+    return acquireSnapshot(&_standardHeaderBlock, &clientConnection->_headersInUse);
+}
+
+void HttpServer::releaseStandardHeaders(ClientConnection* clientConnection)
+{
+    core_util_atomic_store_ptr((void**)&clientConnection->_headersInUse, nullptr);
+
+    if (core_util_atomic_load_s32(&_retiredHeaderCount) > 0 && _headerMutex.trylock()) {
+        reclaimSnapshots(_retiredHeaderBlocks, &_retiredHeaderCount, &ClientConnection::_headersInUse);
+        _headerMutex.unlock();
+    }
+}
+
+/*
+    copy under the mutex, the block can't be replaced meanwhile. No hazard pointer is used
+*/
+void HttpServer::appendStandardHeaders(HttpHeaderWriter& writer)
+{
+    ScopedLock<Mutex> lock(_headerMutex);
+    writer.append(_standardHeaderBlock->data(), _standardHeaderBlock->length());
+}
+
+void HttpServer::beginRouteChanges()
+{
+    beginRouteUpdate();
+}
+
+void HttpServer::endRouteChanges()
+{
+    publishRoutes(_routeChanges);
+}
+
+/*
+    start a change, returns a copy of the current routes. Must be followed by publishRoutes().
+    Within beginRouteChanges() the same copy is returned, before start() the routes are changed in place.
+*/
+HttpRouteTable* HttpServer::beginRouteUpdate()
+{
+    _routeMutex.lock();                                 // recursive, held until publishRoutes()
+    if (_routeChangeDepth++ == 0) {
+        if (_started) {
+            _routeChanges = new HttpRouteTable(*_routes);
+            MBED_ASSERT(_routeChanges);
+        } else {
+            _routeChanges = _routes;                    // no reader yet
+        }
+    }
+    return _routeChanges;
+}
+
+/*
+    make the changed copy the current routes, the old table is deleted when no connection uses it
+*/
+void HttpServer::publishRoutes(HttpRouteTable* routes)
+{
+    MBED_ASSERT(_routeChangeDepth > 0 && routes == _routeChanges);
+    if (--_routeChangeDepth == 0) {
+        if (routes != _routes) {
+            HttpRouteTable* old = (HttpRouteTable*)core_util_atomic_exchange_ptr((void**)&_routes, routes);
+            _retiredRoutes.push_back(old);
+            core_util_atomic_store_s32(&_retiredCount, _retiredRoutes.size());
+            reclaimRoutes();
+        }
+        _routeChanges = nullptr;
+    }
+    _routeMutex.unlock();
+}
+
+/*
+    _routeMutex must be locked
+*/
+void HttpServer::reclaimRoutes()
+{
+    reclaimSnapshots(_retiredRoutes, &_retiredCount, &ClientConnection::_routesInUse);
 }
 
 void HttpServer::addStandardHeader(const char* key, const char* value)
 {
+    ScopedLock<Mutex> lock(_headerMutex);
     standardHeaders[key] = value;
+
+    // line is KEY:VALUE\r\n
+    std::string* block = new std::string();
+    MBED_ASSERT(block);
+    for (auto it : standardHeaders) {
+        *block += it.first;
+        *block += ":";
+        *block += it.second;
+        *block += "\r\n";
+    }
+
+    std::string* old = (std::string*)core_util_atomic_exchange_ptr((void**)&_standardHeaderBlock, block);
+    _retiredHeaderBlocks.push_back(old);
+    reclaimSnapshots(_retiredHeaderBlocks, &_retiredHeaderCount, &ClientConnection::_headersInUse);
 }
 
-const map<string, string>& HttpServer::getStandardHeaders()
+map<string, string> HttpServer::getStandardHeaders()
 {
+    ScopedLock<Mutex> lock(_headerMutex);
     return standardHeaders;
 }
 
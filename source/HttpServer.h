@@ -25,6 +25,12 @@
 #include "WebSocketHandler.h"
 #include "HTTPHandler.h"
 #include "ClientConnection.h"
+#include "HttpBufferPool.h"
+#include "HttpRouter.h"
+#include "HttpStaticRoutes.h"
+#include "HttpDate.h"
+#include "HttpFileCache.h"
+#include "HttpFileReader.h"
 
 #include <string>
 #include <map>
@@ -36,8 +42,17 @@
 #define DEBUG_WEBSOCKETS(...)
 #endif
 
-typedef WebSocketHandler* (*CreateWSHandlerFn)();
-typedef std::map<std::string, CreateWSHandlerFn> WebSocketHandlerContainer;
+/**
+ * \brief server statistics, counters since start
+ */
+struct HttpServerStats {
+    uint32_t acceptQueued;          // connections that had to wait for an idle ClientConnection
+    uint32_t acceptExpired;         // waiting connections closed after accept-queue-timeout
+    uint32_t acceptRejected;        // connections closed because the accept queue was full or no buffer was left
+    uint32_t fileBlockSize;         // block size of the file system, file reads are aligned to it
+    uint32_t fileChunkSize;         // current size of file reads, tuned by throughput
+    uint32_t fileThroughput;        // bytes/s of file sends at the last tuning step
+};
 
 
 /**
@@ -59,15 +74,82 @@ public:
      */
     nsapi_error_t start(uint16_t port);
 
+    /**
+     * register handler for a path pattern, see HttpRouter for the pattern syntax.
+     * The handler for "/" is also used for requests that match no other route.
+     */
     void setHTTPHandler(const char* path, CallbackRequestHandler handler);
+
+    /**
+     * register handler that reads only the given request headers (besides the well known ones).
+     * All other headers are dropped while parsing requests for this path.
+     */
+    void setHTTPHandler(const char* path, CallbackRequestHandler handler, std::initializer_list<const char*> headers);
+
+    /**
+     * register handler for one request method only, e.g. HTTP_POST
+     */
+    void setHTTPHandler(http_method method, const char* path, CallbackRequestHandler handler);
+    void setHTTPHandler(http_method method, const char* path, CallbackRequestHandler handler, std::initializer_list<const char*> headers);
+
+    /**
+     * stream request bodies for path to the callbacks instead of buffering them in the request.
+     * The handler set with setHTTPHandler() is called after end for sending the response.
+     * After a successful begin, either end or abort is called: abort when the request is dropped
+     * before its body is complete, e.g. on a parse error or when the connection is closed.
+     */
+    void setHTTPBodyHandler(const char* path, CallbackBodyBegin begin, CallbackBodyChunk chunk, CallbackBodyEnd end,
+                            CallbackBodyAbort abort = nullptr);
+    void setHTTPBodyHandler(http_method method, const char* path, CallbackBodyBegin begin, CallbackBodyChunk chunk, CallbackBodyEnd end,
+                            CallbackBodyAbort abort = nullptr);
     CallbackRequestHandler getHTTPHandler(const char* path);
 
+    /**
+     * use routes generated by tools/gen_routes.py, they are checked before the routes of setHTTPHandler()
+     * and setWSHandler(). The table must stay valid while the server runs.
+     */
+    void setStaticRoutes(const HttpStaticRouteTable* routes);
+
     void setWSHandler(const char* path, CreateWSHandlerFn handler);
     CreateWSHandlerFn getWSHandler(const char* path);
+
+    /**
+     * change several routes at once: the routes are copied once by beginRouteChanges(), the set and
+     * add functions called until endRouteChanges() change this copy, then it is published as a whole.
+     * Routes that are set before start() are changed in place without copy.
+     */
+    void beginRouteChanges();
+    void endRouteChanges();
+
+    /**
+     * current routes for a request. Lock-free, the table stays valid until releaseRoutes() even if
+     * routes are changed meanwhile.
+     */
+    const HttpRouteTable* acquireRoutes(ClientConnection* clientConnection);
+    void releaseRoutes(ClientConnection* clientConnection);
+
+    /**
+     * serialized standard headers ("Key:Value\r\n" lines) for a response, lock-free like the routes.
+     * The block stays valid until releaseStandardHeaders().
+     */
+    const std::string* acquireStandardHeaders(ClientConnection* clientConnection);
+    void releaseStandardHeaders(ClientConnection* clientConnection);
+
+    // standard headers for a response built outside of the handler thread of its connection
+    void appendStandardHeaders(HttpHeaderWriter& writer);
     void wsSendTextAll(const char* origin, const char* text, int length = 0);
 
+    /**
+     * add a header to all responses. The header block is serialized once here, not per response,
+     * and replaced as a whole. The routes are not affected.
+     */
     void addStandardHeader(const char* key, const char* value);
-    const map<string, string>& getStandardHeaders();
+    map<string, string> getStandardHeaders();
+
+    HttpDateCache& getDateCache() { return _dateCache; };
+
+    // cache for HttpResponseBuilder::sendHeaderAndFile(), enabled with file-cache-size
+    HttpFileCache& getFileCache() { return _fileCache; };
 
     bool isWebsocketAvailable() { return (_nWebSockets < _nWebSocketsMax); };
     int getWebsocketCount() { return _nWebSockets; };
@@ -82,10 +164,44 @@ public:
     };
     
     void decWebsocketCount() { _nWebSockets--; };
-    
+
+    /**
+     * called by a ClientConnection when its socket was closed and its receive loop has ended. Starts the connection again with
+     * the oldest waiting socket from the accept queue, or marks it idle.
+     */
+    void releaseConnection(ClientConnection* clientConnection);
+
+    HttpServerStats getStats();
+    int getClientConnectionCount() { return _clientConnections.size(); };
+    ClientConnectionStats getClientConnectionStats(int index) { return _clientConnections[index]->getStats(); };
+
+    HttpBufferPool& getBufferPool() { return _bufferPool; };
+    HttpBufferPool& getSendBufferPool() { return _sendBufferPool; };
+    HttpBufferPool& getFileReadPool() { return _fileReadPool; };
+    HttpBufferPool& getBodyPool() { return _bodyPool; };
+
+    // queue of the thread that reads files ahead of sending, nullptr if file-read-buffers < 2
+    EventQueue* getFileReaderQueue() { return _fileReaderQueue; };
+    HttpChunkSizer& getChunkSizer() { return _chunkSizer; };
 
 private:
+    struct PendingConnection {
+        TCPSocket* socket;
+        Kernel::Clock::time_point acceptTime;
+    };
+
     void main();
+    void startConnection(ClientConnection* clientConnection, TCPSocket* socket);
+    void pushIdleConnection(ClientConnection* clientConnection);
+    ClientConnection* popIdleConnection();
+    TCPSocket* popPendingConnection();
+    void expirePendingConnections();
+    HttpRouteTable* beginRouteUpdate();
+    void publishRoutes(HttpRouteTable* routes);
+    void reclaimRoutes();
+    template <typename T> static T* acquireSnapshot(T** current, const T** hazard);
+    template <typename T> void reclaimSnapshots(vector<T*>& retired, int32_t* retiredCount, const T* ClientConnection::*hazard);
+
     TCPSocket* _serverSocket;
     NetworkInterface* _network;
     Thread _threadHTTPServer;
@@ -94,11 +210,42 @@ private:
     int _nWebSocketsMax;
     CallbackRequestHandler _handler;
     vector<ClientConnection*> _clientConnections;
-
-    WebSocketHandlerContainer _WSHandlers;
-    HTTPSocketHandlerContainer _HTTPHandlers;
-
-    map<string, string> standardHeaders;
+    ClientConnection* _idleConnections;                 // lock-free stack, linked by ClientConnection::_nextIdle
+    HttpBufferPool _bufferPool;                         // receive buffers for all client connections
+    HttpBufferPool _sendBufferPool;                     // output, response header and chunk buffers, held while a connection writes
+    HttpBufferPool _fileReadPool;                       // rings of HttpFileReader, held while a file is sent
+    HttpBufferPool _bodyPool;                           // buffered request bodies, held until the request is done
+    vector<EventQueue*> _eventQueues;                   // event driven mode only
+    vector<Thread*> _eventThreads;
+    EventQueue* _fileReaderQueue;
+    Thread* _fileReaderThread;
+    HttpChunkSizer _chunkSizer;
+
+    // sockets waiting for an idle ClientConnection, ringbuffer protected by _connectionMutex
+    // (one extra entry, so a queue size of 0 compiles)
+    Mutex _connectionMutex;
+    PendingConnection _pendingConnections[HTTP_ACCEPT_QUEUE_SIZE + 1];
+    int _pendingHead;
+    int _pendingCount;
+    HttpServerStats _stats;
+
+    // routes are replaced as a whole, readers hold a hazard pointer (ClientConnection::_routesInUse)
+    HttpRouteTable* _routes;
+    Mutex _routeMutex;                                  // serializes changes, held from begin to publish
+    HttpRouteTable* _routeChanges;                      // copy that is changed, or _routes before start()
+    int _routeChangeDepth;                              // nested beginRouteUpdate()
+    bool _started;
+    vector<HttpRouteTable*> _retiredRoutes;             // replaced, maybe still in use
+    int32_t _retiredCount;
+
+    // standard headers, replaced as a whole like the routes (hazard pointer ClientConnection::_headersInUse)
+    std::string* _standardHeaderBlock;
+    Mutex _headerMutex;                                 // serializes changes
+    vector<std::string*> _retiredHeaderBlocks;
+    int32_t _retiredHeaderCount;
+    map<string, string> standardHeaders;               // source of _standardHeaderBlock, protected by _headerMutex
+    HttpDateCache _dateCache;
+    HttpFileCache _fileCache;
 };
 
 #endif // __HTTP_SERVER_h__
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __HttpStaticRoutes_h__
+#define __HttpStaticRoutes_h__
+
+#include "HTTPHandler.h"
+#include "HttpStringView.h"
+
+/**
+ * \brief routes known at compile time, in a perfect hash table generated by tools/gen_routes.py.
+ *
+ * The generated table is constexpr and lives in flash. A lookup hashes the path once and compares
+ * it with the single candidate slot. Static routes are checked before the routes registered with
+ * HttpServer::setHTTPHandler(), they receive all request headers and buffered request bodies.
+ */
+typedef void (*HttpStaticHandlerFn)(HttpParsedRequest* request, ClientConnection* connection);
+
+struct HttpStaticRoute {
+    int method;                             // http_method or HTTP_ANY_METHOD
+    HttpStaticHandlerFn handler;
+    CreateWSHandlerFn wsHandler;
+};
+
+// one slot per hash value, routes for the same path and different methods are consecutive
+struct HttpStaticRouteSlot {
+    const char* path;                       // nullptr if the slot is empty
+    uint16_t pathLength;
+    uint16_t firstRoute;
+    uint16_t routeCount;
+};
+
+struct HttpStaticRouteTable {
+    const HttpStaticRouteSlot* slots;
+    uint32_t slotCount;                     // power of 2
+    uint32_t seed;                          // FNV-1a start value found by the generator
+    const HttpStaticRoute* routes;
+
+    /**
+     * A route for the method is preferred. Otherwise the first ANY route, or for HEAD the first
+     * GET route, in the order of the spec file, like HttpRouter::selectRoute().
+     *
+     * @param[in] path       path without query
+     * @param[in] method     request method
+     * @param[in] webSocket  true: only routes with a websocket handler, false: only routes with a request handler
+     * @return route or nullptr
+     */
+    const HttpStaticRoute* find(HttpStringView path, int method, bool webSocket) const
+    {
+        const HttpStaticRouteSlot& slot = slots[path.hash(seed) & (slotCount - 1)];
+        if (slot.path == nullptr || slot.pathLength != path.length || memcmp(slot.path, path.data, path.length) != 0) {
+            return nullptr;
+        }
+
+        const HttpStaticRoute* anyMethodRoute = nullptr;
+        for (int i = slot.firstRoute; i < slot.firstRoute + slot.routeCount; i++) {
+            const HttpStaticRoute* route = &routes[i];
+            if (webSocket ? (route->wsHandler == nullptr) : (route->handler == nullptr)) {
+                continue;
+            }
+            if (route->method == method) {
+                return route;
+            }
+            if (anyMethodRoute == nullptr &&
+                (route->method == HTTP_ANY_METHOD || (method == HTTP_HEAD && route->method == HTTP_GET))) {
+                anyMethodRoute = route;                 // HEAD uses the GET route, too
+            }
+        }
+        return anyMethodRoute;
+    }
+};
+
+#endif
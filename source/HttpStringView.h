@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __HttpStringView_h__
+#define __HttpStringView_h__
+
+#include <string>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * \brief non owning reference to a string, e.g. into the receive buffer. Not null terminated!
+ */
+struct HttpStringView {
+    const char* data;
+    size_t length;
+
+    HttpStringView() : data(nullptr), length(0) {}
+    HttpStringView(const char* a_data, size_t a_length) : data(a_data), length(a_length) {}
+    HttpStringView(const char* str) : data(str), length(str ? strlen(str) : 0) {}
+
+    bool empty() const { return length == 0; }
+
+    std::string str() const { return std::string(data ? data : "", length); }
+
+    bool equals(const char* s) const
+    {
+        return (strlen(s) == length) && (memcmp(data, s, length) == 0);
+    }
+
+    bool equalsIgnoreCase(HttpStringView s) const
+    {
+        if (s.length != length)
+            return false;
+        for (size_t i = 0; i < length; i++) {
+            if (toLower(data[i]) != toLower(s.data[i]))
+                return false;
+        }
+        return true;
+    }
+
+    bool equalsIgnoreCase(const char* s) const
+    {
+        size_t i = 0;
+        for (; i < length && s[i]; i++) {
+            if (toLower(data[i]) != toLower(s[i]))
+                return false;
+        }
+        return (i == length) && (s[i] == '\0');
+    }
+
+    // find s (case insensitive), e.g. a token in a header value
+    bool containsIgnoreCase(const char* s) const
+    {
+        size_t n = strlen(s);
+        for (size_t pos = 0; pos + n <= length; pos++) {
+            if (HttpStringView(data + pos, n).equalsIgnoreCase(s))
+                return true;
+        }
+        return false;
+    }
+
+    // decimal number, stops at the first non digit
+    uint32_t toUInt() const
+    {
+        uint32_t value = 0;
+        size_t i = 0;
+        while (i < length && data[i] == ' ')
+            i++;
+        for (; i < length && data[i] >= '0' && data[i] <= '9'; i++) {
+            value = value * 10 + (data[i] - '0');
+        }
+        return value;
+    }
+
+    // FNV-1a over the lower case characters
+    uint32_t hashIgnoreCase() const
+    {
+        uint32_t hash = FNV_OFFSET_BASIS;
+        for (size_t i = 0; i < length; i++) {
+            hash = (hash ^ (uint8_t)toLower(data[i])) * FNV_PRIME;
+        }
+        return hash;
+    }
+
+    // FNV-1a, case sensitive. basis is the start value, e.g. the seed of a generated hash table
+    uint32_t hash(uint32_t basis = FNV_OFFSET_BASIS) const
+    {
+        uint32_t hash = basis;
+        for (size_t i = 0; i < length; i++) {
+            hash = (hash ^ (uint8_t)data[i]) * FNV_PRIME;
+        }
+        return hash;
+    }
+
+    // same hash as hashIgnoreCase(), usable for compile time constants
+    static constexpr uint32_t hashIgnoreCase(const char* s, uint32_t hash = FNV_OFFSET_BASIS)
+    {
+        return *s ? hashIgnoreCase(s + 1, (hash ^ (uint8_t)toLower(*s)) * FNV_PRIME) : hash;
+    }
+
+    static constexpr char toLower(char c)
+    {
+        return (('A' <= c) && (c <= 'Z')) ? (char)('a' + (c - 'A')) : c;
+    }
+
+    static constexpr uint32_t FNV_OFFSET_BASIS = 2166136261u;
+    static constexpr uint32_t FNV_PRIME = 16777619u;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""
+Generate a perfect hash table of static HTTP routes for HttpServer::setStaticRoutes().
+
+Route spec, one route per line, '#' starts a comment:
+
+    GET   /api/status   handleStatus
+    POST  /api/config   handleConfig
+    ANY   /about        handleAbout
+    WS    /ws           createWsHandler
+
+Handlers are free functions declared by the generated header:
+
+    void handleStatus(HttpParsedRequest* request, ClientConnection* connection);
+    WebSocketHandler* createWsHandler();
+
+Routes for the same path keep their order in the spec. A request takes the route for its method,
+otherwise the first ANY route (HEAD: the first GET route), as for routes set with setHTTPHandler().
+
+Paths are matched exactly, patterns with :param or *wildcard segments must be registered with
+setHTTPHandler(). The table is named after the output file, e.g. routes.h defines 'routes':
+
+    #include "routes.h"
+    server.setStaticRoutes(&routes);
+
+usage: gen_routes.py <spec> <output.h>
+"""
+
+import os
+import re
+import sys
+
+FNV_PRIME = 16777619
+MAX_SEED_TRIES = 100000
+
+METHODS = ('DELETE', 'GET', 'HEAD', 'POST', 'PUT', 'CONNECT', 'OPTIONS', 'TRACE', 'PATCH')
+
+
+def fnv1a(data, basis):
+    h = basis
+    for b in data:
+        h = ((h ^ b) * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def parse_spec(filename):
+    routes = []
+    with open(filename) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            fields = line.split()
+            if len(fields) != 3:
+                sys.exit('%s:%d: expected <method> <path> <handler>' % (filename, lineno))
+            method, path, handler = fields
+            method = method.upper()
+            if method not in METHODS + ('ANY', 'WS'):
+                sys.exit('%s:%d: unknown method %s' % (filename, lineno, method))
+            if not path.startswith('/') or re.search(r'/[:*]', path):
+                sys.exit('%s:%d: %s is not a static path' % (filename, lineno, path))
+            if not re.match(r'^[A-Za-z_][A-Za-z0-9_]*$', handler):
+                sys.exit('%s:%d: %s is not a function name' % (filename, lineno, handler))
+            if any(r[0] == method and r[1] == path for r in routes):
+                sys.exit('%s:%d: duplicate route %s %s' % (filename, lineno, method, path))
+            # HTTP handlers and websocket factories have different prototypes
+            other = next((r for r in routes if r[2] == handler and (r[0] == 'WS') != (method == 'WS')), None)
+            if other:
+                sys.exit('%s:%d: %s is used for %s %s and %s %s, websocket and HTTP routes need different functions'
+                         % (filename, lineno, handler, other[0], other[1], method, path))
+            routes.append((method, path, handler))
+    return routes
+
+
+def find_seed(paths):
+    """smallest power of 2 table and seed without collisions"""
+    slot_count = 1
+    while slot_count < len(paths):
+        slot_count *= 2
+    keys = [p.encode() for p in paths]
+    while True:
+        for seed in range(MAX_SEED_TRIES):
+            basis = fnv1a(seed.to_bytes(4, 'little'), 2166136261)
+            slots = set(fnv1a(k, basis) & (slot_count - 1) for k in keys)
+            if len(slots) == len(keys):
+                return slot_count, basis
+        slot_count *= 2
+
+
+def c_string(s):
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+
+def generate(routes, name, spec):
+    paths = sorted(set(r[1] for r in routes))
+    slot_count, seed = find_seed(paths)
+
+    # routes grouped by path, in path order
+    ordered = [r for p in paths for r in routes if r[1] == p]
+    slots = [None] * slot_count
+    for path in paths:
+        first = next(i for i, r in enumerate(ordered) if r[1] == path)
+        count = sum(1 for r in ordered if r[1] == path)
+        slots[fnv1a(path.encode(), seed) & (slot_count - 1)] = (path, first, count)
+
+    guard = '__%s_h__' % name
+    out = []
+    out.append('// generated by tools/gen_routes.py from %s, do not edit' % os.path.basename(spec))
+    out.append('')
+    out.append('#ifndef %s' % guard)
+    out.append('#define %s' % guard)
+    out.append('')
+    out.append('#include "HttpStaticRoutes.h"')
+    out.append('')
+    for handler in sorted(set(r[2] for r in routes if r[0] != 'WS')):
+        out.append('void %s(HttpParsedRequest* request, ClientConnection* connection);' % handler)
+    for handler in sorted(set(r[2] for r in routes if r[0] == 'WS')):
+        out.append('WebSocketHandler* %s();' % handler)
+    out.append('')
+    out.append('constexpr HttpStaticRoute %s_routes[] = {' % name)
+    for method, path, handler in ordered:
+        if method == 'WS':
+            out.append('    { HTTP_GET, nullptr, %s },' % handler)
+        elif method == 'ANY':
+            out.append('    { HTTP_ANY_METHOD, %s, nullptr },' % handler)
+        else:
+            out.append('    { HTTP_%s, %s, nullptr },' % (method, handler))
+    out.append('};')
+    out.append('')
+    out.append('constexpr HttpStaticRouteSlot %s_slots[] = {' % name)
+    for slot in slots:
+        if slot:
+            out.append('    { %s, %d, %d, %d },' % (c_string(slot[0]), len(slot[0].encode()), slot[1], slot[2]))
+        else:
+            out.append('    { nullptr, 0, 0, 0 },')
+    out.append('};')
+    out.append('')
+    out.append('constexpr HttpStaticRouteTable %s = { %s_slots, %d, 0x%08xu, %s_routes };'
+               % (name, name, slot_count, seed, name))
+    out.append('')
+    out.append('#endif')
+    out.append('')
+    return '\n'.join(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    spec, output = sys.argv[1], sys.argv[2]
+    routes = parse_spec(spec)
+    if not routes:
+        sys.exit('%s: no routes' % spec)
+    name = re.sub(r'\W', '_', os.path.splitext(os.path.basename(output))[0])
+    text = generate(routes, name, spec)
+    with open(output, 'w') as f:
+        f.write(text)
+
+
+if __name__ == '__main__':
+    main()